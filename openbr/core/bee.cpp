@@ -128,15 +128,12 @@ void writeSigset(const QString &sigset, const FileList &files, bool ignoreMetada
     QtUtils::writeFile(sigset, lines);
 }
 
-Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+// Leaves file positioned at the first matrix element
+static void readHeader(QFile &file, QString *targetSigset, QString *querySigset, int *rows, int *cols, bool *isMask, bool *isDistance)
 {
-    QFile file(matrix);
-    bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
-
     // Check format
     QByteArray format = file.readLine();
-    bool isDistance = (format[0] == 'D');
+    *isDistance = (format[0] == 'D');
     if (format[1] != '2') qFatal("Invalid matrix header.");
 
     // Read sigsets
@@ -147,9 +144,43 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
 
     // Get matrix size
     const QStringList words = QString(file.readLine()).split(" ");
-    const int rows = words[1].toInt();
-    const int cols = words[2].toInt();
-    const bool isMask = words[0][1] == 'B';
+    *rows = words[1].toInt();
+    *cols = words[2].toInt();
+    *isMask = words[0][1] == 'B';
+}
+
+static void writeHeader(QFile &file, bool isMask, int rows, int cols, const QString &targetSigset, const QString &querySigset)
+{
+    const QString matrixType = isMask ? "B" : "F";
+
+    char buff[4];
+    file.write("S2\n");
+    file.write(qPrintable(targetSigset));
+    file.write("\n");
+    file.write(qPrintable(querySigset));
+    file.write("\n");
+    file.write("M");
+    file.write(qPrintable(matrixType));
+    file.write(" ");
+    file.write(qPrintable(QString::number(rows)));
+    file.write(" ");
+    file.write(qPrintable(QString::number(cols)));
+    file.write(" ");
+    const int endian = 0x12345678;
+    memcpy(&buff, &endian, 4);
+    file.write(buff, 4);
+    file.write("\n");
+}
+
+Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+{
+    QFile file(matrix);
+    bool success = file.open(QFile::ReadOnly);
+    if (!success) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
+
+    int rows, cols;
+    bool isMask, isDistance;
+    readHeader(file, targetSigset, querySigset, &rows, &cols, &isMask, &isDistance);
     const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
 
     // Get matrix data
@@ -176,6 +207,30 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
     return result;
 }
 
+Mat mapMatrix(const File &matrix, QFile &file, bool *negate, QString *targetSigset, QString *querySigset, bool writable)
+{
+    file.setFileName(matrix);
+    if (!file.open(writable ? QFile::ReadWrite : QFile::ReadOnly))
+        qFatal("Unable to open %s for %s.", qPrintable(matrix.name), writable ? "writing" : "reading");
+
+    int rows, cols;
+    bool isMask, isDistance;
+    readHeader(file, targetSigset, querySigset, &rows, &cols, &isMask, &isDistance);
+    const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+
+    const qint64 offset = file.pos();
+    const qint64 bytes = qint64(rows) * cols * typeSize;
+    if (file.size() < offset + bytes) qFatal("Didn't read complete row!");
+    if (file.size() > offset + bytes) qFatal("Expected matrix end of file.");
+
+    uchar *data = bytes ? file.map(offset, bytes) : NULL;
+    if (bytes && !data)
+        qFatal("Unable to map %s.", qPrintable(matrix.name));
+
+    if (negate != NULL) *negate = isDistance ^ matrix.get<bool>("negate", false);
+    return Mat(rows, cols, isMask ? OpenCVType<BEE::MaskValue,1>::make() : OpenCVType<BEE::SimmatValue,1>::make(), data);
+}
+
 void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
 {
     bool isMask = false;
@@ -185,33 +240,42 @@ void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSig
         qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
 
     const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-    const QString matrixType = isMask ? "B" : "F";
 
-    char buff[4];
     QFile file(fileName);
     QtUtils::touchDir(file);
     if (!file.open(QFile::WriteOnly))
         qFatal("Unable to open %s for writing.", qPrintable(fileName));
-    file.write("S2\n");
-    file.write(qPrintable(targetSigset));
-    file.write("\n");
-    file.write(qPrintable(querySigset));
-    file.write("\n");
-    file.write("M");
-    file.write(qPrintable(matrixType));
-    file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
-    file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
-    file.write(" ");
-    const int endian = 0x12345678;
-    memcpy(&buff, &endian, 4);
-    file.write(buff, 4);
-    file.write("\n");
+    writeHeader(file, isMask, m.rows, m.cols, targetSigset, querySigset);
     file.write((const char*)m.data, m.rows*m.cols*elemSize);
     file.close();
 }
 
+Mat createMatrix(QFile &file, int rows, int cols, int type, const QString &targetSigset, const QString &querySigset)
+{
+    const bool isMask = (type == OpenCVType<BEE::MaskValue,1>::make());
+    if (!isMask && (type != OpenCVType<BEE::SimmatValue,1>::make()))
+        qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
+
+    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::ReadWrite | QFile::Truncate))
+        qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
+    writeHeader(file, isMask, rows, cols, targetSigset, querySigset);
+    file.flush();
+
+    // Extending the file zero fills the matrix
+    const qint64 offset = file.pos();
+    const qint64 bytes = qint64(rows) * cols * elemSize;
+    if (!file.resize(offset + bytes))
+        qFatal("Unable to allocate %s.", qPrintable(file.fileName()));
+
+    uchar *data = bytes ? file.map(offset, bytes) : NULL;
+    if (bytes && !data)
+        qFatal("Unable to map %s.", qPrintable(file.fileName()));
+    return Mat(rows, cols, type, data);
+}
+
 void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
 {
     qDebug("Reading %s header.", qPrintable(matrix));
@@ -294,13 +358,19 @@ Mat makeMask(const FileList &targets, const FileList &queries, int partition)
 {
     // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
     // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
+    return makeMask(targets, queries,
+                    File::get<QString>(targets, "Label", "-1"), File::get<QString>(queries, "Label", "-1"),
+                    targets.crossValidationPartitions(), queries.crossValidationPartitions(),
+                    partition, 0, queries.size());
+}
 
-    Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
+Mat makeMask(const FileList &targets, const FileList &queries,
+             const QStringList &targetLabels, const QStringList &queryLabels,
+             const QList<int> &targetPartitions, const QList<int> &queryPartitions,
+             int partition, int queryBegin, int queryEnd)
+{
+    Mat mask(queryEnd - queryBegin, targets.size(), CV_8UC1);
+    for (int i=queryBegin; i<queryEnd; i++) {
         const QString &fileA = queries[i];
         const QString labelA = queryLabels[i];
         const int partitionA = queryPartitions[i];
@@ -319,7 +389,7 @@ Mat makeMask(const FileList &targets, const FileList &queries, int partition)
             else if (partitionB != partition)  val = DontCare;
             else if (labelA == labelB)         val = Match;
             else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
+            mask.at<MaskValue>(i-queryBegin,j) = val;
         }
     }
 
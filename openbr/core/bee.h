@@ -17,6 +17,7 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
 #include <QString>
 #include <QStringList>
 #include <opencv2/core/core.hpp>
@@ -43,9 +44,20 @@ namespace BEE
     BR_EXPORT void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
     BR_EXPORT void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
 
+    // Memory mapped matrix, valid while file remains open. Elements are read-only unless writable is set, and *negate
+    // is set if they must be negated to match readMatrix(), i.e. for distance matrices.
+    BR_EXPORT cv::Mat mapMatrix(const br::File &mat, QFile &file, bool *negate, QString *targetSigset = NULL, QString *querySigset = NULL, bool writable = false);
+    // Zero initialized, memory mapped, writable matrix. The file name must be set and the result is valid while file remains open.
+    BR_EXPORT cv::Mat createMatrix(QFile &file, int rows, int cols, int type, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+
     // Mask
     BR_EXPORT void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     BR_EXPORT cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
+    // Rows [queryBegin, queryEnd) of the mask, from labels and cross validation partitions computed once by the caller
+    BR_EXPORT cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries,
+                               const QStringList &targetLabels, const QStringList &queryLabels,
+                               const QList<int> &targetPartitions, const QList<int> &queryPartitions,
+                               int partition, int queryBegin, int queryEnd);
     BR_EXPORT void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     BR_EXPORT cv::Mat makePairwiseMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     BR_EXPORT void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method);
@@ -1,6 +1,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/core/opencvutils.h>
 #include <QDebug>
+#include <QTemporaryFile>
 
 #include "boost.h"
 #include "cxmisc.h"
@@ -163,16 +164,74 @@ CascadeBoostParams::CascadeBoostParams(int _boostType,
     use_surrogates = use_1se_rule = truncate_pruned_tree = false;
 }
 
+//---------------------------- PrecalcBuffer -----------------------------
+
+// Rows of precalculated feature data, the first rows in memory and the rest
+// spilled to a memory-mapped temporary file on local disk
+struct PrecalcBuffer
+{
+    Mat memory;
+    QTemporaryFile spill;
+    uchar *mapped;
+    uint64_t rowBytes;
+    int memoryRows, rows;
+
+    PrecalcBuffer() : mapped(NULL), rowBytes(0), memoryRows(0), rows(0) {}
+
+    // Allocates up to maxRows rows within memoryBytes of RAM and spillBytes of disk, returns the number of rows allocated
+    int allocate(int maxRows, uint64_t _rowBytes, uint64_t memoryBytes, uint64_t spillBytes)
+    {
+        release();
+        rowBytes = _rowBytes;
+        if (rowBytes == 0)
+            return 0;
+
+        memoryRows = (int)min((uint64_t)maxRows, memoryBytes / rowBytes);
+        const int spillRows = (int)min((uint64_t)(maxRows - memoryRows), spillBytes / rowBytes);
+        rows = memoryRows + spillRows;
+
+        if (memoryRows > 0)
+            memory.create(memoryRows, (int)rowBytes, CV_8UC1);
+
+        if (spillRows > 0) {
+            const qint64 spillSize = (qint64)spillRows * (qint64)rowBytes;
+            if (!spill.open() || !spill.resize(spillSize) || !(mapped = spill.map(0, spillSize)))
+                qFatal("Failed to map %s for precalculated features.", qPrintable(spill.fileName()));
+            qDebug() << "Spilled" << spillRows << "precalculated features to" << spill.fileName();
+        }
+        return rows;
+    }
+
+    void release()
+    {
+        memory.release();
+        if (mapped) {
+            spill.unmap(mapped);
+            mapped = NULL;
+        }
+        if (spill.isOpen())
+            spill.resize(0);
+        spill.close();
+        memoryRows = rows = 0;
+    }
+
+    inline uchar *row(int i) const
+    {
+        return i < memoryRows ? memory.data + (uint64_t)i*rowBytes
+                              : mapped + (uint64_t)(i - memoryRows)*rowBytes;
+    }
+};
+
 //---------------------------- CascadeBoostTrainData -----------------------------
 
 struct CascadeBoostTrainData : CvDTreeTrainData
 {
     CascadeBoostTrainData(const FeatureEvaluator* _featureEvaluator, int _channels, const CvDTreeParams& _params);
     CascadeBoostTrainData(const FeatureEvaluator* _featureEvaluator,
-                          int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize, int _channels,
+                          int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize, int _precalcSpillSize, int _channels,
                           const CvDTreeParams& _params = CvDTreeParams());
     virtual void setData(const FeatureEvaluator* _featureEvaluator,
-                         int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize,
+                         int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize, int _precalcSpillSize,
                          const CvDTreeParams& _params=CvDTreeParams());
 
     void initVarType();
@@ -196,9 +255,24 @@ struct CascadeBoostTrainData : CvDTreeTrainData
     virtual float getVarValue(int vi, int si);
     virtual void free_train_data();
 
+    inline float getCachedValue(int vi, int si) const
+    {
+        const uchar *row = valCache.row(vi);
+        if (valueSize == 1) return valueTable.at(row[si]);
+        if (valueSize == 2) return valueTable.at(((const ushort*)row)[si]);
+        return ((const float*)row)[si];
+    }
+
+    void setCachedValues(int vi, const float *values);
+    const int* getSortedIndices(CvDTreeNode* n, int vi, int* indicesBuf) const;
+    void setSortedIndices(int bufIdx, int vi, int offset, const int* indices, int count);
+
     const FeatureEvaluator* featureEvaluator;
 
-    cv::Mat valCache; // precalculated feature values (CV_32FC1)
+    PrecalcBuffer valCache; // precalculated feature values, codes into valueTable when quantized
+    PrecalcBuffer idxCache; // precalculated sorted sample indices, one row per feature holding every node buffer
+    QVector<float> valueTable;
+    int valueSize, indexSize;
     CvMat _resp; // for casting
 
     int numPrecalcVal, numPrecalcIdx, channels;
@@ -297,7 +371,7 @@ CvDTreeNode* CascadeBoostTrainData::subsample_data( const CvMat* _subsample_idx
             int num_valid = data_root->get_num_valid(vi);
             CV_Assert( num_valid == sample_count );
 
-            int* idst_idx = buf->data.i + root->buf_idx*getLength() + (uint64_t)vi*sample_count + root->offset;
+            cv::AutoBuffer<int> idst_idx(count);
             for( int i = 0; i < num_valid; i++ )
             {
                 idx = src_idx[i];
@@ -306,6 +380,7 @@ CvDTreeNode* CascadeBoostTrainData::subsample_data( const CvMat* _subsample_idx
                     for( cur_ofs = co[idx*2+1]; count_i > 0; count_i--, j++, cur_ofs++ )
                         idst_idx[j] = cur_ofs;
             }
+            setSortedIndices( root->buf_idx, vi, root->offset, idst_idx, j );
         }
 
         // subsample cv_lables
@@ -340,6 +415,9 @@ CascadeBoostTrainData::CascadeBoostTrainData(const FeatureEvaluator* _featureEva
 
     featureEvaluator = _featureEvaluator;
     channels = _channels;
+    numPrecalcVal = numPrecalcIdx = 0;
+    valueSize = sizeof(float);
+    indexSize = sizeof(int);
     shared = true;
     set_params( _params );
     max_c_count = MAX( 2, featureEvaluator->getMaxCatCount() );
@@ -382,16 +460,16 @@ void CascadeBoostTrainData::initVarType()
 
 CascadeBoostTrainData::CascadeBoostTrainData(const FeatureEvaluator* _featureEvaluator,
                                               int _numSamples,
-                                              int _precalcValBufSize, int _precalcIdxBufSize, int _channels ,
+                                              int _precalcValBufSize, int _precalcIdxBufSize, int _precalcSpillSize, int _channels,
                                               const CvDTreeParams& _params)
 {
     channels = _channels;
-    setData( _featureEvaluator, _numSamples, _precalcValBufSize, _precalcIdxBufSize, _params );
+    setData( _featureEvaluator, _numSamples, _precalcValBufSize, _precalcIdxBufSize, _precalcSpillSize, _params );
 }
 
 void CascadeBoostTrainData::setData( const FeatureEvaluator* _featureEvaluator,
                                      int _numSamples,
-                                     int _precalcValBufSize, int _precalcIdxBufSize,
+                                     int _precalcValBufSize, int _precalcIdxBufSize, int _precalcSpillSize,
                                      const CvDTreeParams& _params )
 {
     int* idst = 0;
@@ -418,21 +496,38 @@ void CascadeBoostTrainData::setData( const FeatureEvaluator* _featureEvaluator,
     responses = &_resp;
     // TODO: check responses: elements must be 0 or 1
 
-    if( _precalcValBufSize < 0 || _precalcIdxBufSize < 0)
-        CV_Error( CV_StsOutOfRange, "_numPrecalcVal and _numPrecalcIdx must be positive or 0" );
+    if( _precalcValBufSize < 0 || _precalcIdxBufSize < 0 || _precalcSpillSize < 0 )
+        CV_Error( CV_StsOutOfRange, "_numPrecalcVal, _numPrecalcIdx and _precalcSpillSize must be positive or 0" );
 
     var_count = var_all = featureEvaluator->getNumFeatures() * featureEvaluator->getFeatureSize();
     sample_count = _numSamples;
 
     is_buf_16u = false;
 
-    // 1048576 is the number of bytes in a megabyte
-    numPrecalcVal = min( cvRound((double)_precalcValBufSize*1048576. / (sizeof(float)*sample_count)), var_count );
-    numPrecalcIdx = min( cvRound((double)_precalcIdxBufSize*1048576. / (sizeof (int)*sample_count)), var_count );
+    // Categorical values and ordered values from a small enough set are cached as 8 or 16-bit codes
+    valueTable.clear();
+    if ( featureEvaluator->getMaxCatCount() > 0 )
+    {
+        for( int c = 0; c < featureEvaluator->getMaxCatCount(); c++ )
+            valueTable.append( (float)c );
+    }
+    else
+    {
+        valueTable = featureEvaluator->getFeatureValues();
+    }
+    if ( valueTable.isEmpty() || valueTable.size() > 65536 )
+    {
+        valueTable.clear();
+        valueSize = sizeof(float);
+    }
+    else
+    {
+        valueSize = valueTable.size() <= 256 ? sizeof(uchar) : sizeof(ushort);
+    }
 
-    assert( numPrecalcIdx >= 0 && numPrecalcVal >= 0 );
+    // Sorted sample indices fit in 16 bits for up to 65536 samples
+    indexSize = sample_count <= 65536 ? sizeof(ushort) : sizeof(int);
 
-    valCache.create( numPrecalcVal, sample_count, CV_32FC1 );
     var_type = cvCreateMat( 1, var_count + 2, CV_32SC1 );
 
     if ( featureEvaluator->getMaxCatCount() > 0 )
@@ -459,9 +554,28 @@ void CascadeBoostTrainData::setData( const FeatureEvaluator* _featureEvaluator,
 
     initVarType();
 
-    work_var_count = ( cat_var_count ? 0 : numPrecalcIdx ) + 1/*cv_lables*/;
+    work_var_count = 1/*cv_lables*/;
     buf_count = 2;
 
+    // The budgets count one of the node buffers, the spill is shared in proportion to what doesn't fit in memory.
+    // 1048576 is the number of bytes in a megabyte
+    const uint64_t valRowBytes = (uint64_t)valueSize*sample_count;
+    const uint64_t idxRowBytes = (uint64_t)indexSize*sample_count*buf_count;
+    const uint64_t valMemory = (uint64_t)_precalcValBufSize*1048576;
+    const uint64_t idxMemory = (uint64_t)_precalcIdxBufSize*1048576*buf_count;
+    const uint64_t valNeeded = (uint64_t)var_count*valRowBytes > valMemory ? (uint64_t)var_count*valRowBytes - valMemory : 0;
+    const uint64_t idxNeeded = cat_var_count ? 0 : ((uint64_t)var_count*idxRowBytes > idxMemory ? (uint64_t)var_count*idxRowBytes - idxMemory : 0);
+    const uint64_t spill = (uint64_t)_precalcSpillSize*1048576;
+    uint64_t valSpill = valNeeded, idxSpill = idxNeeded;
+    if ( valNeeded + idxNeeded > spill )
+    {
+        valSpill = (uint64_t)((double)spill * valNeeded / (valNeeded + idxNeeded));
+        idxSpill = spill - valSpill;
+    }
+
+    numPrecalcVal = valCache.allocate( var_count, valRowBytes, valMemory, valSpill );
+    numPrecalcIdx = cat_var_count ? 0 : idxCache.allocate( var_count, idxRowBytes, idxMemory, idxSpill );
+
     buf_size = -1; // the member buf_size is obsolete
 
     effective_buf_size = getLength()*buf_count;
@@ -534,6 +648,57 @@ void CascadeBoostTrainData::free_train_data()
 {
     CvDTreeTrainData::free_train_data();
     valCache.release();
+    idxCache.release();
+}
+
+void CascadeBoostTrainData::setCachedValues(int vi, const float* values)
+{
+    uchar *row = valCache.row(vi);
+    if (valueSize == sizeof(float)) {
+        memcpy(row, values, sample_count*sizeof(float));
+        return;
+    }
+
+    const bool categorical = cat_var_count > 0;
+    for (int si = 0; si < sample_count; si++) {
+        int code;
+        if (categorical) {
+            code = (int)values[si];
+        } else {
+            const float *value = std::lower_bound(valueTable.constBegin(), valueTable.constEnd(), values[si]);
+            if ((value == valueTable.constEnd()) || (*value != values[si]))
+                qFatal("Value %g of feature %d is not one of the representation's feature values.", values[si], vi);
+            code = (int)(value - valueTable.constBegin());
+        }
+
+        if (valueSize == sizeof(uchar)) row[si] = (uchar)code;
+        else                            ((ushort*)row)[si] = (ushort)code;
+    }
+}
+
+const int* CascadeBoostTrainData::getSortedIndices(CvDTreeNode* n, int vi, int* indicesBuf) const
+{
+    const uchar *src = idxCache.row(vi) + ((uint64_t)n->buf_idx*sample_count + n->offset)*indexSize;
+    if (indexSize == sizeof(int))
+        return (const int*)src;
+
+    const ushort *usrc = (const ushort*)src;
+    for (int i = 0; i < n->sample_count; i++)
+        indicesBuf[i] = usrc[i];
+    return indicesBuf;
+}
+
+void CascadeBoostTrainData::setSortedIndices(int bufIdx, int vi, int offset, const int* indices, int count)
+{
+    uchar *dst = idxCache.row(vi) + ((uint64_t)bufIdx*sample_count + offset)*indexSize;
+    if (indexSize == sizeof(int)) {
+        memcpy(dst, indices, count*sizeof(int));
+        return;
+    }
+
+    ushort *udst = (ushort*)dst;
+    for (int i = 0; i < count; i++)
+        udst[i] = (ushort)indices[i];
 }
 
 const int* CascadeBoostTrainData::get_class_labels( CvDTreeNode* n, int* labelsBuf)
@@ -578,14 +743,14 @@ void CascadeBoostTrainData::get_ord_var_data( CvDTreeNode* n, int vi, float* ord
     // For this feature (this code refers to features as values, hence vi == value index),
     // have we precalculated (presorted) the training samples by their feature response?
     if (vi < numPrecalcIdx) {
-        *sortedIndices = getBufferValues(n, vi);
+        *sortedIndices = getSortedIndices(n, vi, sortedIndicesBuf);
 
         // For this feature, have we precalculated all of the feature responses?
         if (vi < numPrecalcVal) {
             for (int i = 0; i < nodeSampleCount; i++) {
                 int idx = (*sortedIndices)[i];
                 idx = sampleIndices[idx];
-                ordValuesBuf[i] = valCache.at<float>(vi, idx);
+                ordValuesBuf[i] = getCachedValue(vi, idx);
             }
         } else {
             for (int i = 0; i < nodeSampleCount; i++) {
@@ -601,7 +766,7 @@ void CascadeBoostTrainData::get_ord_var_data( CvDTreeNode* n, int vi, float* ord
         if (vi < numPrecalcVal) {
             for (int i = 0; i < nodeSampleCount; i++) {
                 sortedIndicesBuf[i] = i;
-                sampleValues[i] = valCache.at<float>( vi, sampleIndices[i] );
+                sampleValues[i] = getCachedValue( vi, sampleIndices[i] );
             }
         } else {
             for (int i = 0; i < nodeSampleCount; i++) {
@@ -631,7 +796,7 @@ const int* CascadeBoostTrainData::get_cat_var_data( CvDTreeNode* n, int vi, int*
     if ( vi < numPrecalcVal )
     {
         for( int i = 0; i < nodeSampleCount; i++ )
-            catValuesBuf[i] = (int) valCache.at<float>( vi, sampleIndices[i]);
+            catValuesBuf[i] = (int) getCachedValue( vi, sampleIndices[i] );
     }
     else
     {
@@ -651,116 +816,53 @@ const int* CascadeBoostTrainData::get_cat_var_data( CvDTreeNode* n, int vi, int*
 
 float CascadeBoostTrainData::getVarValue( int vi, int si )
 {
-    if ( vi < numPrecalcVal && !valCache.empty() )
-        return valCache.at<float>( vi, si );
+    if ( vi < numPrecalcVal )
+        return getCachedValue( vi, si );
     return (*featureEvaluator)( vi, si );
 }
 
 struct Precalc : ParallelLoopBody
 {
-    const FeatureEvaluator* featureEvaluator;
-    int sampleCount;
+    CascadeBoostTrainData *data;
 
-    Precalc(const FeatureEvaluator* featureEvaluator, int sampleCount) :
-        featureEvaluator(featureEvaluator),
-        sampleCount(sampleCount)
+    Precalc(CascadeBoostTrainData *data) :
+        data(data)
     {}
 
-    virtual void operator()(const Range& range) const = 0;
-};
-
-struct IndexPrecalc : Precalc
-{
-    int* idst;
-    unsigned short* udst;
-
-    IndexPrecalc(const FeatureEvaluator* featureEvaluator, CvMat* buf, int sampleCount) :
-        Precalc(featureEvaluator, sampleCount),
-        idst(buf->data.i)
-    {}
-
-    void setBuffer(uint64_t fi, uint64_t si) const
-    {
-        *(idst + fi*sampleCount + si) = si;
-    }
-
-    void sortBuffer(uint64_t fi, float *valCachePtr) const
-    {
-        icvSortIntAux(idst + fi*sampleCount, sampleCount, valCachePtr);
-    }
-
     virtual void operator()(const Range& range) const
     {
-        cv::AutoBuffer<float> valCache(sampleCount);
-        float* valCachePtr = (float*)valCache;
-        for (int fi = range.start; fi < range.end; fi++) {
-            for (int si = 0; si < sampleCount; si++) {
-                valCachePtr[si] = (*featureEvaluator)(fi, si);
-                setBuffer(fi, si);
-            }
-            sortBuffer(fi, valCachePtr);
-        }
-    }
-};
+        const int sampleCount = data->sample_count;
+        cv::AutoBuffer<float> values(sampleCount);
+        cv::AutoBuffer<int> indices(sampleCount);
 
-struct FeatureAndIndexPrecalc : IndexPrecalc
-{
-    Mat *valCache;
-
-    FeatureAndIndexPrecalc(const FeatureEvaluator* featureEvaluator, CvMat* buf, Mat* valCache, int sampleCount) :
-        IndexPrecalc(featureEvaluator, buf, sampleCount),
-        valCache(valCache)
-    {}
-
-    virtual void operator()(const Range& range) const
-    {
         for (int fi = range.start; fi < range.end; fi++) {
-            for (int si = 0; si < sampleCount; si++) {
-                valCache->at<float>(fi,si) = (*featureEvaluator)(fi, si);
-                setBuffer(fi, si);
+            for (int si = 0; si < sampleCount; si++)
+                values[si] = (*data->featureEvaluator)(fi, si);
+
+            if (fi < data->numPrecalcVal)
+                data->setCachedValues(fi, values);
+
+            // Sort training samples by their feature response
+            if (fi < data->numPrecalcIdx) {
+                for (int si = 0; si < sampleCount; si++)
+                    indices[si] = si;
+                icvSortIntAux(indices, sampleCount, values);
+                // The root node starts at offset 0 of buffer 0
+                data->setSortedIndices(0, fi, 0, indices, sampleCount);
             }
-            sortBuffer(fi, valCache->ptr<float>(fi));
         }
     }
 };
 
-struct FeaturePrecalc : Precalc
-{
-    Mat *valCache;
-
-    FeaturePrecalc(const FeatureEvaluator* featureEvaluator, Mat* valCache, int sampleCount) :
-        Precalc(featureEvaluator, sampleCount),
-        valCache(valCache)
-    {}
-
-    virtual void operator()(const Range& range) const
-    {
-        for (int fi = range.start; fi < range.end; fi++)
-            for (int si = 0; si < sampleCount; si++)
-                valCache->at<float>(fi,si) = (*featureEvaluator)(fi, si);
-    }
-};
-
 void CascadeBoostTrainData::precalculate()
 {
-    int minPrecalc = std::min(numPrecalcVal, numPrecalcIdx);
-
-    qDebug() << "Starting precalculation...";
+    qDebug() << "Starting precalculation of" << numPrecalcVal << "feature values and" << numPrecalcIdx << "sorted indices...";
 
     QTime time;
     time.start();
 
-    // Compute features and sort training samples for feature indices we are not going to cache
-    parallel_for_(Range(numPrecalcVal, numPrecalcIdx),
-                  IndexPrecalc(featureEvaluator, buf, sample_count));
-
-    // Compute features and sort training samples for features indices we are going to cache
-    parallel_for_(Range(0, minPrecalc),
-                  FeatureAndIndexPrecalc(featureEvaluator, buf, &valCache, sample_count));
-
-    // Compute feature values for feature indices for which we are not going to sort training samples
-    parallel_for_(Range(minPrecalc, numPrecalcVal),
-                  FeaturePrecalc(featureEvaluator, &valCache, sample_count));
+    // Compute features, caching the values and sorting the training samples by them as the budgets allow
+    parallel_for_(Range(0, max(numPrecalcVal, numPrecalcIdx)), Precalc(this));
 
     cout << "Precalculation time (ms): " << time.elapsed() << endl;
 }
@@ -794,6 +896,90 @@ CvDTreeNode* CascadeBoostTree::predict( int sampleIdx ) const
     return node;
 }
 
+namespace br
+{
+
+// Searches a run of features for the best split of a node, the equivalent of
+// OpenCV's DTreeBestSplitFinder with one best split per chunk of features.
+struct BestSplitFinder : ParallelLoopBody
+{
+    CascadeBoostTree *tree;
+    CvDTreeNode *node;
+    int chunkSize, splitSize;
+    uchar *splits;
+
+    BestSplitFinder(CascadeBoostTree *tree, CvDTreeNode *node, int chunkSize, int splitSize, uchar *splits) :
+        tree(tree),
+        node(node),
+        chunkSize(chunkSize),
+        splitSize(splitSize),
+        splits(splits)
+    {}
+
+    virtual void operator()(const Range& range) const
+    {
+        CvDTreeTrainData *data = tree->get_data();
+        const int n = node->sample_count;
+        cv::AutoBuffer<uchar> inn_buf(2*n*(sizeof(int) + sizeof(float)));
+        cv::AutoBuffer<uchar> split_buf(splitSize);
+        CvDTreeSplit *split = (CvDTreeSplit*)(uchar*)split_buf;
+
+        for (int chunk = range.start; chunk < range.end; chunk++) {
+            CvDTreeSplit *bestSplit = (CvDTreeSplit*)(splits + (size_t)chunk*splitSize);
+            memset(bestSplit, 0, splitSize);
+            bestSplit->quality = -1;
+            bestSplit->condensed_idx = INT_MIN;
+
+            const int end = min((chunk + 1)*chunkSize, data->var_count);
+            for (int vi = chunk*chunkSize; vi < end; vi++) {
+                if (node->get_num_valid(vi) <= 1)
+                    continue;
+
+                memset(split, 0, splitSize);
+                const int ci = data->get_var_type(vi);
+                CvDTreeSplit *res;
+                if (data->is_classifier)
+                    res = ci >= 0 ? tree->find_split_cat_class(node, vi, bestSplit->quality, split, inn_buf)
+                                  : tree->find_split_ord_class(node, vi, bestSplit->quality, split, inn_buf);
+                else
+                    res = ci >= 0 ? tree->find_split_cat_reg(node, vi, bestSplit->quality, split, inn_buf)
+                                  : tree->find_split_ord_reg(node, vi, bestSplit->quality, split, inn_buf);
+
+                if (res && bestSplit->quality < split->quality)
+                    memcpy(bestSplit, split, splitSize);
+            }
+        }
+    }
+};
+
+} // namespace br
+
+// Features are searched in parallel chunks, the first feature with the highest
+// quality wins as it would in a serial search.
+CvDTreeSplit* CascadeBoostTree::find_best_split( CvDTreeNode* node )
+{
+    const int splitSize = data->split_heap->elem_size;
+    const int chunks = min(data->var_count, max(getNumThreads(), 1) * 16);
+    const int chunkSize = (data->var_count + chunks - 1) / chunks;
+    cv::AutoBuffer<uchar> splits((size_t)chunks*splitSize);
+
+    parallel_for_(Range(0, chunks), BestSplitFinder(this, node, chunkSize, splitSize, splits));
+
+    const CvDTreeSplit *best = NULL;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        const CvDTreeSplit *split = (const CvDTreeSplit*)((uchar*)splits + (size_t)chunk*splitSize);
+        if (!best || (best->quality < split->quality))
+            best = split;
+    }
+
+    CvDTreeSplit *bestSplit = 0;
+    if (best && (best->quality > 0)) {
+        bestSplit = data->new_split_cat(0, -1.0f);
+        memcpy(bestSplit, best, splitSize);
+    }
+    return bestSplit;
+}
+
 // This function splits the training data from the parent node into training
 // data for both child nodes
 void CascadeBoostTree::split_node_data( CvDTreeNode* node )
@@ -829,19 +1015,22 @@ void CascadeBoostTree::split_node_data( CvDTreeNode* node )
 
     bool splitInputData = node->depth + 1 < data->params.max_depth && (node->left->sample_count > data->params.min_sample_count || node->right->sample_count > data->params.min_sample_count);
 
-    const int numPreculatedIndices = ((CascadeBoostTrainData*)data)->numPrecalcIdx;
+    CascadeBoostTrainData *trainData = (CascadeBoostTrainData*)data;
+    const int numPreculatedIndices = trainData->numPrecalcIdx;
     for (int vi = 0; vi < numPreculatedIndices; vi++) {
         int ci = data->get_var_type(vi);
         if( ci >= 0 || !splitInputData )
             continue;
 
-        const int* src_sorted_idx = ((CascadeBoostTrainData*)data)->getBufferValues(node, vi);
-        for(uint64_t i = 0; i < nodeSampleCount; i++)
-            tempBuf[i] = src_sorted_idx[i];
+        // Copy the parent's indices since the children may share its buffer
+        const int* src_sorted_idx = trainData->getSortedIndices(node, vi, tempBuf);
+        if (src_sorted_idx != tempBuf)
+            for(uint64_t i = 0; i < nodeSampleCount; i++)
+                tempBuf[i] = src_sorted_idx[i];
 
         int *ldst, *rdst;
-        ldst = buf->data.i + left->buf_idx*length_buf_row + vi*sampleCount + left->offset;
-        rdst = buf->data.i + right->buf_idx*length_buf_row + vi*sampleCount + right->offset;
+        ldst = tempBuf + nodeSampleCount;
+        rdst = ldst + nLeft;
 
         int n1 = node->get_num_valid(vi);
 
@@ -858,6 +1047,9 @@ void CascadeBoostTree::split_node_data( CvDTreeNode* node )
                 ldst++;
             }
         }
+
+        trainData->setSortedIndices(left->buf_idx, vi, left->offset, tempBuf + nodeSampleCount, (int)nLeft);
+        trainData->setSortedIndices(right->buf_idx, vi, right->offset, tempBuf + nodeSampleCount + nLeft, (int)nRight);
     }
 
     // split cv_labels using newIdx relocation table
@@ -921,6 +1113,7 @@ void CascadeBoost::train(const FeatureEvaluator* _featureEvaluator,
                          int _numSamples,
                          int _precalcValBufSize,
                          int _precalcIdxBufSize,
+                         int _precalcSpillSize,
                          int _channels,
                          const CascadeBoostParams& _params)
 {
@@ -930,7 +1123,7 @@ void CascadeBoost::train(const FeatureEvaluator* _featureEvaluator,
     channels = _channels;
 
     data = new CascadeBoostTrainData(_featureEvaluator, _numSamples,
-                                        _precalcValBufSize, _precalcIdxBufSize, channels, _params);
+                                        _precalcValBufSize, _precalcIdxBufSize, _precalcSpillSize, channels, _params);
 
     set_params(_params);
     if ((_params.boost_type == LOGIT) || (_params.boost_type == GENTLE))
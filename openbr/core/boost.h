@@ -16,6 +16,7 @@ struct FeatureEvaluator
 
     int getNumFeatures() const { return representation->numFeatures(); }
     int getMaxCatCount() const { return representation->maxCatCount(); }
+    QVector<float> getFeatureValues() const { return representation->featureValues(); }
     int getFeatureSize() const { return 1; }
     const cv::Mat& getCls() const { return cls; }
     float getCls(int si) const { return cls.at<float>(si, 0); }
@@ -36,13 +37,18 @@ struct CascadeBoostParams : CvBoostParams
     virtual ~CascadeBoostParams() {}
 };
 
+struct BestSplitFinder;
+
 class CascadeBoostTree : public CvBoostTree
 {
+    friend struct BestSplitFinder;
+
 public:
     using CvBoostTree::predict;
     virtual CvDTreeNode* predict(int sampleIdx) const;
 
 protected:
+    virtual CvDTreeSplit* find_best_split(CvDTreeNode* n);
     virtual void split_node_data(CvDTreeNode* n);
 };
 
@@ -51,7 +57,7 @@ class CascadeBoost : public CvBoost
 public:
     using CvBoost::train;
     virtual void train(const FeatureEvaluator *_featureEvaluator,
-                       int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize, int _channels,
+                       int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize, int _precalcSpillSize, int _channels,
                        const CascadeBoostParams &_params=CascadeBoostParams());
 
     using CvBoost::predict;
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QTemporaryFile>
 #include <openbr/openbr_plugin.h>
 
 #include "bee.h"
@@ -28,6 +29,41 @@ void noDelete(Transform *target)
     (void) target;
 }
 
+// Shards of a sharded gallery manifest within its [begin, end) range, with their template counts
+static FileList readShards(const File &gallery, QList<qint64> *counts = NULL)
+{
+    FileList shards;
+    if (!QFileInfo(gallery.name).exists())
+        return shards;
+
+    const QDir dir = QFileInfo(gallery.name).dir();
+    foreach (const QString &line, QtUtils::readLines(gallery.name)) {
+        const QStringList words = line.simplified().split(' ', QString::SkipEmptyParts);
+        if (words.isEmpty() || words.first().startsWith('#'))
+            continue;
+        shards.append(File(dir.filePath(words[0])));
+        if (counts)
+            counts->append(words.value(1).toLongLong());
+    }
+
+    const int begin = qBound(0, gallery.get<int>("begin", 0), shards.size());
+    const int end = gallery.get<int>("end", -1) < 0 ? shards.size() : qBound(begin, gallery.get<int>("end", -1), shards.size());
+    if (counts)
+        *counts = counts->mid(begin, end - begin);
+    return shards.mid(begin, end - begin);
+}
+
+// True if the gallery holds enrolled templates, a sharded gallery does if its shards do
+static bool isEnrolledGallery(const File &gallery)
+{
+    const QStringList enrolledSuffixes = QStringList() << "gal" << "mem" << "template" << "t";
+    if (gallery.suffix() != "shards")
+        return enrolledSuffixes.contains(gallery.suffix());
+
+    const FileList shards = readShards(gallery);
+    return !shards.isEmpty() && enrolledSuffixes.contains(shards.first().suffix());
+}
+
 struct AlgorithmCore
 {
     enum CompareMode
@@ -86,7 +122,21 @@ struct AlgorithmCore
         if (!distance.isNull() && distance->trainable()) {
             if (!transform.isNull()) {
                 qDebug("Projecting Enrollment");
-                trainingWrapper->projectUpdate(data,data);
+                if (Globals->streamTraining) {
+                    // Release each block of raw templates as soon as it is projected,
+                    // so the raw and projected training sets are never both resident
+                    TemplateList projected;
+                    for (int i=0; i<data.size(); i+=Globals->blockSize) {
+                        TemplateList block = data.mid(i, Globals->blockSize);
+                        for (int j=i; j<i+block.size(); j++)
+                            data[j] = Template();
+                        trainingWrapper->projectUpdate(block, block);
+                        projected.append(block);
+                    }
+                    data = projected;
+                } else {
+                    trainingWrapper->projectUpdate(data,data);
+                }
             }
 
             TemplateList distanceData;
@@ -183,6 +233,8 @@ struct AlgorithmCore
         }
         if (mode == TransformCompare)
             comparison = QSharedPointer<Transform>(Transform::deserialize(in));
+
+        compressedRead.close();
     }
 
     File getMemoryGallery(const File &file) const
@@ -277,7 +329,7 @@ struct AlgorithmCore
 
     void retrieveOrEnroll(const File &file, QScopedPointer<Gallery> &gallery, FileList &galleryFiles)
     {
-        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "t").contains(file.suffix())) {
+        if (!file.getBool("enroll") && isEnrolledGallery(file)) {
             // Retrieve it
             gallery.reset(Gallery::make(file));
             galleryFiles = gallery->files();
@@ -410,6 +462,12 @@ struct AlgorithmCore
         if (output.exists() && output.get<bool>("cache", false)) return;
         if (queryGallery == ".") queryGallery = targetGallery;
 
+        // A sharded target gallery is compared one shard at a time into its columns of the output matrix
+        if ((targetGallery.suffix() == "shards") && (output.suffix() == "mtx") && !(targetGallery == queryGallery)) {
+            compareShards(targetGallery, queryGallery, output);
+            return;
+        }
+
         // To decide which gallery is larger, we need to read both, but at this point we just want the
         // metadata, and don't need the enrolled matrices.
         FileList targetMetadata;
@@ -454,7 +512,7 @@ struct AlgorithmCore
             colEnrolledGallery = colGallery.baseName() + colGallery.hash() + '.' + targetExtension;
 
             // Check if we have to do real enrollment, and not just convert the gallery's type.
-            if (!(QStringList() << "gal" << "template" << "mem" << "t").contains(colGallery.suffix()))
+            if (!isEnrolledGallery(colGallery))
                 enroll(colGallery, colEnrolledGallery);
 
             // If the gallery does have enrolled templates, but is not the right type, we do a simple
@@ -476,7 +534,7 @@ struct AlgorithmCore
         // which compares incoming templates against a gallery, we will handle enrollment of the row set by simply
         // building a transform that does enrollment (using the current algorithm), then does the comparison in one
         // step. This way, we don't have to retain the complete enrolled row gallery in memory, or on disk.
-        else if (!(QStringList() << "gal" << "mem" << "template" << "t").contains(rowGallery.suffix()))
+        else if (!isEnrolledGallery(rowGallery))
             needEnrollRows = true;
 
         // At this point, we have decided how we will structure the comparison (either in transpose mode, or not), 
@@ -504,6 +562,24 @@ struct AlgorithmCore
         if (needEnrollRows)
             enrollCompare.prepend(simplifiedTransform.data());
 
+        // In multi-process mode a .mtx output is preallocated here and then written in place by the worker
+        // processes, each storing the rows (or columns in transpose mode) it compared. This process only tracks
+        // progress, rather than funneling every score through a single sequential Output stage.
+        const bool tiledOutput = multiProcess && (output.suffix() == "mtx") && Globals->file.getBool("tiledCompare", true);
+        QScopedPointer<Transform> matrixTile;
+        if (tiledOutput) {
+            {
+                QFile matrixFile(output.name);
+                cv::Mat scores = BEE::createMatrix(matrixFile, queryMetadata.size(), targetMetadata.size(), CV_32FC1, targetGallery.flat(), queryGallery.flat());
+                scores.setTo(-std::numeric_limits<float>::max());
+            }
+
+            matrixTile.reset(Transform::make("MatrixTile", NULL));
+            matrixTile->setPropertyRecursive("matrix", output.name);
+            matrixTile->setPropertyRecursive("transposeMode", transposeMode);
+            enrollCompare.append(matrixTile.data());
+        }
+
         Transform *compareRegionBase = pipeTransforms(enrollCompare);
         // If in multi-process mode, wrap the enroll+compare structure in a ProcessWrapper.
         if (multiProcess)
@@ -534,7 +610,7 @@ struct AlgorithmCore
 
         // Now, we will give that base transform to a stream, which will incrementally read the row gallery
         // and pass the transforms it reads through the base algorithm.
-        QScopedPointer<Transform> streamWrapper(br::wrapTransform(pipeline, "Stream(readMode=StreamGallery, endPoint="+outputRegionDesc+"+DiscardTemplates)"));
+        QScopedPointer<Transform> streamWrapper(br::wrapTransform(pipeline, "Stream(readMode=StreamGallery, endPoint="+(tiledOutput ? QString() : outputRegionDesc+"+")+"DiscardTemplates)"));
 
         // We set up a template containing the rowGallery we want to compare. 
         TemplateList rowGalleryTemplate;
@@ -548,6 +624,56 @@ struct AlgorithmCore
         streamWrapper->projectUpdate(rowGalleryTemplate, outputGallery);
     }
 
+    // Compares the query gallery against each shard in manifest order, copying the shard's scores into the next
+    // columns of the output. Only one shard is enrolled in memory at a time, and the result is identical to comparing
+    // against the concatenated shards regardless of how each shard's comparison is parallelized.
+    void compareShards(const File &targetGallery, const File &queryGallery, const File &output)
+    {
+        QList<qint64> counts;
+        const FileList shards = readShards(targetGallery, &counts);
+        qint64 targetCount = 0;
+        foreach (qint64 count, counts)
+            targetCount += count;
+
+        // Enroll the query gallery once rather than for every shard
+        File enrolledQueryGallery = queryGallery;
+        if (!isEnrolledGallery(queryGallery)) {
+            enrolledQueryGallery = queryGallery.baseName() + queryGallery.hash() + ".mem";
+            enroll(queryGallery, enrolledQueryGallery);
+        }
+        const int queryCount = FileList::fromGallery(enrolledQueryGallery, true).size();
+
+        QFile matrixFile(output.name);
+        cv::Mat scores = BEE::createMatrix(matrixFile, queryCount, int(targetCount), CV_32FC1, targetGallery.flat(), queryGallery.flat());
+
+        int column = 0;
+        for (int i=0; i<shards.size(); i++) {
+            // Empty shards are never created on disk
+            if (counts[i] == 0)
+                continue;
+
+            QTemporaryFile shardMatrix(QFileInfo(output.name).absoluteDir().filePath("XXXXXX.mtx"));
+            if (!shardMatrix.open())
+                qFatal("Unable to create a temporary matrix for %s.", qPrintable(shards[i].name));
+            shardMatrix.close();
+
+            File shardOutput(output);
+            shardOutput.name = shardMatrix.fileName();
+            shardOutput.remove("cache");
+            compare(shards[i], enrolledQueryGallery, shardOutput);
+
+            QFile shardFile;
+            bool negate;
+            const cv::Mat shardScores = BEE::mapMatrix(shardOutput, shardFile, &negate);
+            if ((shardScores.rows != queryCount) || (shardScores.cols != counts[i]) || (column + shardScores.cols > scores.cols))
+                qFatal("Expected a %dx%d matrix comparing shard %s, got %dx%d.", queryCount, int(counts[i]), qPrintable(shards[i].name), shardScores.rows, shardScores.cols);
+
+            cv::Mat columns = scores.colRange(column, column + shardScores.cols);
+            shardScores.convertTo(columns, CV_32FC1, negate ? -1 : 1);
+            column += shardScores.cols;
+        }
+    }
+
 private:
     QString name;
 
@@ -3,6 +3,8 @@
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/common.h"
 
+#include <QBitArray>
+#include <QtConcurrent>
 #include <opencv2/highgui/highgui.hpp>
 
 using namespace std;
@@ -122,32 +124,83 @@ QMap<QString, Detections> EvalUtils::filterDetections(const QMap<QString, Detect
     return allFilteredDetections;
 }
 
-int EvalUtils::associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+namespace
+{
+
+// Truth boxes sorted by left edge, so the truths that can overlap a predicted box are found by binary search
+struct TruthIndex
 {
+    QVector<QRectF> boxes;
+    QVector<int> order;
+    QVector<qreal> lefts;
+    qreal maxWidth;
+
+    TruthIndex(const QList<Detection> &truth) : maxWidth(0)
+    {
+        QVector< QPair<qreal,int> > sorted; sorted.reserve(truth.size());
+        for (int t=0; t<truth.size(); t++) {
+            boxes.append(truth[t].boundingBox.normalized());
+            sorted.append(qMakePair(boxes[t].left(), t));
+            maxWidth = std::max(maxWidth, boxes[t].width());
+        }
+        std::sort(sorted.begin(), sorted.end());
+        for (int i=0; i<sorted.size(); i++) {
+            lefts.append(sorted[i].first);
+            order.append(sorted[i].second);
+        }
+    }
+
+    void candidates(const QRectF &box, QVector<int> &truths) const
+    {
+        truths.clear();
+        const QRectF r = box.normalized();
+        for (int k=int(std::upper_bound(lefts.begin(), lefts.end(), r.right()) - lefts.begin())-1; (k >= 0) && (lefts[k] >= r.left()-maxWidth); k--) {
+            const QRectF &truth = boxes[order[k]];
+            if ((truth.right() >= r.left()) && (truth.top() <= r.bottom()) && (truth.bottom() >= r.top()))
+                truths.append(order[k]);
+        }
+    }
+};
+
+struct ImageAssociation
+{
+    QList<ResolvedDetection> resolved, falseNegative;
     QList<float> dLeft, dRight, dTop, dBottom;
-    int count = 0, totalTrueDetections = 0;
+    int totalTrueDetections;
+    ImageAssociation() : totalTrueDetections(0) {}
+};
+
+struct AssociateImage
+{
+    typedef ImageAssociation result_type;
+    const QRectF offsets;
 
-    foreach (Detections detections, all.values()) {
+    AssociateImage(const QRectF &offsets) : offsets(offsets) {}
+
+    ImageAssociation operator()(const Detections &detections) const
+    {
+        ImageAssociation result;
         for (int i=0; i<detections.truth.size(); i++)
-            if (!detections.truth[i].ignore) totalTrueDetections++;
+            if (!detections.truth[i].ignore) result.totalTrueDetections++;
 
         // Try to associate ground truth detections with predicted detections
-        QList<SortedDetection> sortedDetections; sortedDetections.reserve(detections.truth.size() * detections.predicted.size());
-        for (int t = 0; t < detections.truth.size(); t++) {
-            const Detection truth = detections.truth[t];
-            for (int p = 0; p < detections.predicted.size(); p++) {
-                Detection predicted = detections.predicted[p];
-
-                float predictedWidth = predicted.boundingBox.width();
-                float x, y, width, height;
-                x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
-                y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
-                width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
-                height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
-                Detection newPredicted(QRectF(x, y, width, height), predicted.filePath, 0.0);
-
-                const float overlap = truth.overlap(newPredicted);
-
+        const TruthIndex index(detections.truth);
+        QVector<int> truths;
+        QList<SortedDetection> sortedDetections;
+        for (int p = 0; p < detections.predicted.size(); p++) {
+            const Detection &predicted = detections.predicted[p];
+
+            float predictedWidth = predicted.boundingBox.width();
+            float x, y, width, height;
+            x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
+            y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
+            width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
+            height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
+            const Detection newPredicted(QRectF(x, y, width, height), predicted.filePath, 0.0);
+
+            index.candidates(newPredicted.boundingBox, truths);
+            foreach (int t, truths) {
+                const float overlap = detections.truth[t].overlap(newPredicted);
                 if (overlap > 0)
                     sortedDetections.append(SortedDetection(t, p, overlap));
             }
@@ -155,39 +208,68 @@ int EvalUtils::associateGroundTruthDetections(QList<ResolvedDetection> &resolved
 
         std::sort(sortedDetections.begin(), sortedDetections.end());
 
-        QList<int> removedTruth;
-        QList<int> removedPredicted;
+        QBitArray removedTruth(detections.truth.size());
+        QBitArray removedPredicted(detections.predicted.size());
 
         foreach (const SortedDetection &detection, sortedDetections) {
-            if (removedTruth.contains(detection.truth_idx) || removedPredicted.contains(detection.predicted_idx))
+            if (removedTruth.testBit(detection.truth_idx) || removedPredicted.testBit(detection.predicted_idx))
                 continue;
 
-            const Detection truth = detections.truth[detection.truth_idx];
-            const Detection predicted = detections.predicted[detection.predicted_idx];
+            const Detection &truth = detections.truth[detection.truth_idx];
+            const Detection &predicted = detections.predicted[detection.predicted_idx];
 
             if (!truth.ignore)
-                resolved.append(ResolvedDetection(predicted.filePath, predicted.boundingBox, predicted.confidence, detection.overlap, truth.boundingBox, truth.pose == predicted.pose));
+                result.resolved.append(ResolvedDetection(predicted.filePath, predicted.boundingBox, predicted.confidence, detection.overlap, truth.boundingBox, truth.pose == predicted.pose));
 
-            removedTruth.append(detection.truth_idx);
-            removedPredicted.append(detection.predicted_idx);
+            removedTruth.setBit(detection.truth_idx);
+            removedPredicted.setBit(detection.predicted_idx);
 
             if (offsets.x() == 0 && detection.overlap > 0.3) {
-                count++;
                 float width = predicted.boundingBox.width();
-                dLeft.append((truth.boundingBox.left() - predicted.boundingBox.left()) / width);
-                dRight.append((truth.boundingBox.right() - predicted.boundingBox.right()) / width);
-                dTop.append((truth.boundingBox.top() - predicted.boundingBox.top()) / width);
-                dBottom.append((truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width);
+                result.dLeft.append((truth.boundingBox.left() - predicted.boundingBox.left()) / width);
+                result.dRight.append((truth.boundingBox.right() - predicted.boundingBox.right()) / width);
+                result.dTop.append((truth.boundingBox.top() - predicted.boundingBox.top()) / width);
+                result.dBottom.append((truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width);
             }
         }
 
         // False positive
         for (int i = 0; i < detections.predicted.size(); i++)
-            if (!removedPredicted.contains(i)) resolved.append(ResolvedDetection(detections.predicted[i].filePath, detections.predicted[i].boundingBox, detections.predicted[i].confidence, 0, QRectF(), false));
+            if (!removedPredicted.testBit(i)) result.resolved.append(ResolvedDetection(detections.predicted[i].filePath, detections.predicted[i].boundingBox, detections.predicted[i].confidence, 0, QRectF(), false));
 
         // False negative
         for (int i = 0; i < detections.truth.size(); i++)
-            if (!removedTruth.contains(i) && !detections.truth[i].ignore) falseNegative.append(ResolvedDetection(detections.truth[i].filePath, detections.truth[i].boundingBox, -std::numeric_limits<float>::max(), 0, QRectF(), false));
+            if (!removedTruth.testBit(i) && !detections.truth[i].ignore) result.falseNegative.append(ResolvedDetection(detections.truth[i].filePath, detections.truth[i].boundingBox, -std::numeric_limits<float>::max(), 0, QRectF(), false));
+
+        return result;
+    }
+};
+
+} // namespace
+
+int EvalUtils::associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+{
+    QList<float> dLeft, dRight, dTop, dBottom;
+    int totalTrueDetections = 0;
+
+    // Images are associated independently, then merged in image order so the results do not depend on scheduling
+    const QList<Detections> images = all.values();
+    QList<ImageAssociation> associations;
+    if (Globals->parallelism) {
+        associations = QtConcurrent::blockingMapped< QList<ImageAssociation> >(images, AssociateImage(offsets));
+    } else {
+        const AssociateImage associate(offsets);
+        foreach (const Detections &detections, images)
+            associations.append(associate(detections));
+    }
+    foreach (const ImageAssociation &association, associations) {
+        totalTrueDetections += association.totalTrueDetections;
+        resolved.append(association.resolved);
+        falseNegative.append(association.falseNegative);
+        dLeft.append(association.dLeft);
+        dRight.append(association.dRight);
+        dTop.append(association.dTop);
+        dBottom.append(association.dBottom);
     }
 
     if (offsets.x() == 0) {
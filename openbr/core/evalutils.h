@@ -40,7 +40,13 @@ struct SortedDetection
     SortedDetection() : truth_idx(-1), predicted_idx(-1), overlap(-1) {}
     SortedDetection(int truth_idx_, int predicted_idx_, float overlap_)
         : truth_idx(truth_idx_), predicted_idx(predicted_idx_), overlap(overlap_) {}
-    inline bool operator<(const SortedDetection &other) const { return overlap > other.overlap; }
+    // Ties are broken by index so association does not depend on the order candidates were found in
+    inline bool operator<(const SortedDetection &other) const
+    {
+        if (overlap != other.overlap) return overlap > other.overlap;
+        if (truth_idx != other.truth_idx) return truth_idx < other.truth_idx;
+        return predicted_idx < other.predicted_idx;
+    }
 };
 
 struct ResolvedDetection
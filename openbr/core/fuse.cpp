@@ -14,8 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFileInfo>
 #include <QList>
+#include <QSharedPointer>
 #include <QStringList>
+#include <QtConcurrent>
 #include "openbr/core/opencvutils.h"
 #include <limits>
 #include <vector>
@@ -28,29 +31,126 @@
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+namespace
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
 
-    if (method == "None") return;
+// Summary of the valid scores in one matrix, accumulated one block at a time
+struct ScoreStatistics
+{
+    qint64 count;
+    float min, max;
+    double mean, m2; // m2 is the sum of squared deviations from mean
+
+    ScoreStatistics() : count(0), min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()), mean(0), m2(0) {}
+
+    void add(float val)
+    {
+        count++;
+        min = std::min(min, val);
+        max = std::max(max, val);
+        const double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+    }
+
+    // Chan et al. pairwise update
+    void add(const ScoreStatistics &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        mean += delta * other.count / total;
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    double stddev() const
+    {
+        return count ? sqrt(m2 / count) : 0;
+    }
+};
+
+// Both passes visit the same aligned row blocks of every input
+struct FusePasses
+{
+    QList<Mat> inputs; // Memory mapped, not yet negated
+    QList<bool> negate;
+    br::FileList targets, queries;
+    QStringList targetLabels, queryLabels;
+    QList<int> targetPartitions, queryPartitions;
+    QString normalization, fusion;
+    QList<float> weights;
+    int partitions, blockRows;
+
+    QVector<ScoreStatistics> blockStatistics; // Indexed by (block*partitions + partition)*inputs + input
+    QVector<ScoreStatistics> statistics;      // Indexed by partition*inputs + input
+    Mat output;
+
+    int blocks() const
+    {
+        return (inputs.first().rows + blockRows - 1) / blockRows;
+    }
+
+    // Mask rows of one block, from labels and partitions looked up once for every block
+    Mat mask(int partition, int begin, int end) const
+    {
+        return BEE::makeMask(targets, queries, targetLabels, queryLabels, targetPartitions, queryPartitions, partition, begin, end);
+    }
+
+    // A writable copy of the block, negated if necessary
+    Mat readBlock(int input, int begin, int end) const
+    {
+        Mat block;
+        if (negate[input]) inputs[input].rowRange(begin, end).convertTo(block, -1, -1);
+        else               inputs[input].rowRange(begin, end).copyTo(block);
+        return block;
+    }
+};
+
+} // namespace
+
+static bool isValid(float val, BEE::MaskValue mask)
+{
+    return (mask != BEE::DontCare) &&
+           (val != -std::numeric_limits<float>::max()) &&
+           (val !=  std::numeric_limits<float>::max());
+}
+
+// First pass, statistics of one row block for every partition and input
+static void measureBlock(FusePasses *passes, int block)
+{
+    const int begin = block * passes->blockRows;
+    const int end = std::min(begin + passes->blockRows, passes->queries.size());
+    const int inputs = passes->inputs.size();
 
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
-                continue;
-            vals.append(val);
+    for (int p=0; p<passes->partitions; p++) {
+        const Mat mask = passes->mask(p, begin, end);
+        for (int k=0; k<inputs; k++) {
+            // Read in place, there is no need for a negated copy
+            const Mat matrix = passes->inputs[k].rowRange(begin, end);
+            const float sign = passes->negate[k] ? -1 : 1;
+            ScoreStatistics &statistics = passes->blockStatistics[(block*passes->partitions + p)*inputs + k];
+            for (int i=0; i<matrix.rows; i++) {
+                const float *vals = matrix.ptr<float>(i);
+                const BEE::MaskValue *maskVals = mask.ptr<BEE::MaskValue>(i);
+                for (int j=0; j<matrix.cols; j++) {
+                    const float val = sign * vals[j];
+                    if (isValid(val, maskVals[j]))
+                        statistics.add(val);
+                }
+            }
         }
     }
+}
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
+static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method, const ScoreStatistics &statistics)
+{
+    if (method == "None") return;
+
+    const float min = statistics.min, max = statistics.max;
+    const double mean = statistics.mean, stddev = statistics.stddev();
 
     if (method == "MinMax") {
         for (int i=0; i<matrix.rows; i++) {
@@ -78,90 +178,162 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
     }
 }
 
+static Mat fuseMatrices(QList<Mat> &matrices, const Mat &matrix_mask, const QString &fusion, const QList<float> &weights)
+{
+    Mat fused;
+    if (fusion == "Max") {
+        max(matrices[0], matrices[1], fused);
+        for (int i=2; i<matrices.size(); i++)
+            max(fused, matrices[i], fused);
+    } else if (fusion == "Min") {
+        min(matrices[0], matrices[1], fused);
+        for (int i=2; i<matrices.size(); i++)
+            min(fused, matrices[i], fused);
+    } else if (fusion.startsWith("Sum")) {
+        addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
+        for (int i=2; i<matrices.size(); i++)
+            addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
+    } else if (fusion == "Replace") {
+        fused = matrices.first().clone();
+        matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
+    } else if (fusion == "Difference") {
+        subtract(matrices[0], matrices[1], fused);
+    } else if (fusion == "None") {
+        fused = matrices[0];
+    } else {
+        qFatal("Invalid fusion method %s.", qPrintable(fusion));
+    }
+    return fused;
+}
+
+// Second pass, fuses one row block of every input into the corresponding output rows
+static void fuseBlock(const FusePasses *passes, int block)
+{
+    const int begin = block * passes->blockRows;
+    const int end = std::min(begin + passes->blockRows, passes->queries.size());
+    const int inputs = passes->inputs.size();
+
+    Mat buffer = passes->output.rowRange(begin, end);
+    for (int p=0; p<passes->partitions; p++) {
+        const Mat matrix_mask = passes->mask(p, begin, end);
+
+        QList<Mat> matrices;
+        for (int k=0; k<inputs; k++) {
+            matrices.append(passes->readBlock(k, begin, end));
+            normalizeMatrix(matrices[k], matrix_mask, passes->normalization, passes->statistics[p*inputs + k]);
+        }
+
+        // We don't want to add scores where the mask says we shouldn't care
+        add(buffer, fuseMatrices(matrices, matrix_mask, passes->fusion, passes->weights), buffer, matrix_mask != BEE::DontCare);
+    }
+}
+
+template <typename Passes>
+static void runBlocks(void (*function)(Passes*, int), Passes *passes)
+{
+    QFutureSynchronizer<void> futures;
+    for (int block=0; block<passes->blocks(); block++)
+        futures.addFuture(QtConcurrent::run(function, passes, block));
+    futures.waitForFinished();
+}
+
+// Inputs are memory mapped and processed in aligned row blocks, first to gather normalization statistics
+// and then to fuse, so neither the inputs nor the output need to fit in memory.
 void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
 {
     qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
 
+    FusePasses passes;
+    passes.normalization = normalization;
+    passes.fusion = fusion;
+
     QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
+    QList< QSharedPointer<QFile> > inputFiles;
+    bool replacesInput = false;
     foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMatrix(simmat,&target,&query));
+        const File input(simmat);
+        replacesInput = replacesInput || (QFileInfo(input.name) == QFileInfo(outputSimmat));
+
+        bool negate;
+        inputFiles.append(QSharedPointer<QFile>(new QFile()));
+        passes.inputs.append(BEE::mapMatrix(input, *inputFiles.last(), &negate, &target, &query));
+        passes.negate.append(negate);
         // Make we're fusing score matrices for the same set of targets and querys
         if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
             qFatal("Target or query files are not the same across fused matrices.");
         previousTarget = target; previousQuery = query;
+        if (passes.inputs.last().size() != passes.inputs.first().size())
+            qFatal("Similarity matrix (%d, %d) and (%d, %d) size mismatch.", passes.inputs.first().rows, passes.inputs.first().cols, passes.inputs.last().rows, passes.inputs.last().cols);
     }
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if ((passes.inputs.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+    if ((passes.inputs.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if (passes.inputs.first().type() != OpenCVType<BEE::SimmatValue,1>::make()) qFatal("Expected similarity matrices.");
 
-    const FileList targetFiles = TemplateList::fromGallery(target).files();
-    const FileList queryFiles = TemplateList::fromGallery(query).files();
-
-    int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
-    do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
-            QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
-            if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
-                    weights.append(1);
-            } else if (words.size() == matrices.size()) {
-                bool ok;
-                for (int k=0; k<matrices.size(); k++) {
-                    float weight = words[k].toFloat(&ok);
-                    if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
-                    weights.append(weight);
-                }
-            } else {
-                qFatal("Number of weights does not match number of similarity matrices.");
+    if (fusion.startsWith("Sum")) {
+        QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
+        if (words.size() == 0) {
+            for (int k=0; k<passes.inputs.size(); k++)
+                passes.weights.append(1);
+        } else if (words.size() == passes.inputs.size()) {
+            bool ok;
+            for (int k=0; k<passes.inputs.size(); k++) {
+                float weight = words[k].toFloat(&ok);
+                if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
+                passes.weights.append(weight);
             }
-
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
         } else {
-            qFatal("Invalid fusion method %s.", qPrintable(fusion));
+            qFatal("Number of weights does not match number of similarity matrices.");
         }
+    } else if ((fusion == "Replace") || (fusion == "Difference")) {
+        if (passes.inputs.size() != 2) qFatal("%s fusion requires exactly two matrices.", qPrintable(fusion));
+    } else if ((fusion != "Max") && (fusion != "Min") && (fusion != "None")) {
+        qFatal("Invalid fusion method %s.", qPrintable(fusion));
+    }
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
+    if ((normalization != "None") && (normalization != "MinMax") && (normalization != "ZScore"))
+        qFatal("Invalid normalization method %s.", qPrintable(normalization));
+
+    passes.targets = TemplateList::fromGallery(target).files();
+    passes.queries = TemplateList::fromGallery(query).files();
+    if ((passes.inputs.first().rows != passes.queries.size()) || (passes.inputs.first().cols != passes.targets.size()))
+        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", passes.inputs.first().rows, passes.inputs.first().cols, passes.queries.size(), passes.targets.size());
 
-        add(buffer,fused,buffer,buffer_mask);
+    passes.targetLabels = File::get<QString>(passes.targets, "Label", "-1");
+    passes.queryLabels = File::get<QString>(passes.queries, "Label", "-1");
+    passes.targetPartitions = passes.targets.crossValidationPartitions();
+    passes.queryPartitions = passes.queries.crossValidationPartitions();
+    passes.partitions = std::max(Globals->crossValidate, 1);
+    // Blocks of at least 16 rows, about 4 MB per input for smaller galleries
+    passes.blockRows = std::max(16, (1 << 20) / std::max(passes.targets.size(), 1));
+    if (passes.queries.isEmpty())
+        qFatal("Expected at least one query.");
 
-        partition++;
+    if (normalization != "None") {
+        passes.blockStatistics.resize(passes.blocks() * passes.partitions * passes.inputs.size());
+        runBlocks(measureBlock, &passes);
 
-    } while (partition < crossValidate);
+        // Blocks are combined in order so the result doesn't depend on scheduling
+        passes.statistics.resize(passes.partitions * passes.inputs.size());
+        for (int block=0; block<passes.blocks(); block++)
+            for (int i=0; i<passes.statistics.size(); i++)
+                passes.statistics[i].add(passes.blockStatistics[block*passes.statistics.size() + i]);
+    } else {
+        passes.statistics.resize(passes.partitions * passes.inputs.size());
+    }
 
-    BEE::writeMatrix(buffer, outputSimmat);
+    // An input can't be overwritten while it is still mapped
+    QFile outputFile(replacesInput ? outputSimmat + ".partial" : outputSimmat);
+    passes.output = BEE::createMatrix(outputFile, passes.inputs.first().rows, passes.inputs.first().cols, OpenCVType<BEE::SimmatValue,1>::make());
+    runBlocks(fuseBlock, const_cast<const FusePasses*>(&passes));
+    passes.output = Mat();
+    outputFile.close();
+
+    if (replacesInput) {
+        passes.inputs.clear();
+        inputFiles.clear();
+        QFile::remove(outputSimmat);
+        if (!QFile::rename(outputFile.fileName(), outputSimmat))
+            qFatal("Unable to rename %s to %s.", qPrintable(outputFile.fileName()), qPrintable(outputSimmat));
+    }
 }
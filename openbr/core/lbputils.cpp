@@ -0,0 +1,152 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <assert.h>
+#include <limits>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "lbputils.h"
+
+using namespace cv;
+
+/* Returns the number of 0->1 or 1->0 transitions in i */
+static int numTransitions(int i)
+{
+    int transitions = 0;
+    int curParity = i%2;
+    for (int j=1; j<=8; j++) {
+        int parity = (i>>(j%8)) % 2;
+        if (parity != curParity) transitions++;
+        curParity = parity;
+    }
+    return transitions;
+}
+
+static int rotationInvariantEquivalent(int i)
+{
+    int min = std::numeric_limits<int>::max();
+    for (int j=0; j<8; j++) {
+        bool parity = i % 2;
+        i = i >> 1;
+        if (parity) i+=128;
+        min = std::min(min, i);
+    }
+    return min;
+}
+
+uchar LBPUtils::makeLUT(uchar lut[256], int maxTransitions, bool rotationInvariant)
+{
+    bool set[256];
+    uchar uid = 0;
+    for (int i=0; i<256; i++) {
+        if (numTransitions(i) <= maxTransitions) {
+            int id;
+            if (rotationInvariant) {
+                int rie = rotationInvariantEquivalent(i);
+                if (i == rie) id = uid++;
+                else          id = lut[rie];
+            } else            id = uid++;
+            lut[i] = id;
+            set[i] = true;
+        } else {
+            set[i] = false;
+        }
+    }
+
+    const uchar null = uid;
+    for (int i=0; i<256; i++)
+        if (!set[i])
+            lut[i] = null; // Set to null id
+    return null;
+}
+
+// Pattern ids for row r of a continuous single channel float image
+static void codeRow(const float *p, int rows, int cols, int r, int radius, const uchar *lut, uchar null, uchar *codes)
+{
+    if ((r < radius) || (r >= rows-radius) || (cols <= 2*radius)) {
+        memset(codes, null, cols);
+        return;
+    }
+
+    memset(codes, null, radius);
+    memset(codes+cols-radius, null, radius);
+
+    const float *up = p + (r-radius)*cols;
+    const float *mid = p + r*cols;
+    const float *down = p + (r+radius)*cols;
+    const int end = cols - radius;
+    int c = radius;
+
+#ifdef __SSE2__
+    // Compare four centers against their neighbors at once, the lookup stays scalar
+    const __m128i w128 = _mm_set1_epi32(128), w64 = _mm_set1_epi32(64), w32 = _mm_set1_epi32(32), w16 = _mm_set1_epi32(16),
+                  w8 = _mm_set1_epi32(8), w4 = _mm_set1_epi32(4), w2 = _mm_set1_epi32(2), w1 = _mm_set1_epi32(1);
+    for (; c+4<=end; c+=4) {
+        const __m128 cval = _mm_loadu_ps(mid+c);
+        __m128i code =            _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(up+c-radius),   cval)), w128);
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(up+c),          cval)), w64));
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(up+c+radius),   cval)), w32));
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(mid+c+radius),  cval)), w16));
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(down+c+radius), cval)), w8));
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(down+c),        cval)), w4));
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(down+c-radius), cval)), w2));
+        code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(mid+c-radius),  cval)), w1));
+
+        int buffer[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(buffer), code);
+        codes[c+0] = lut[buffer[0]];
+        codes[c+1] = lut[buffer[1]];
+        codes[c+2] = lut[buffer[2]];
+        codes[c+3] = lut[buffer[3]];
+    }
+#endif
+
+    for (; c<end; c++) {
+        const float cval = mid[c];
+        codes[c] = lut[(up[c-radius]   >= cval ? 128 : 0) |
+                       (up[c]          >= cval ? 64  : 0) |
+                       (up[c+radius]   >= cval ? 32  : 0) |
+                       (mid[c+radius]  >= cval ? 16  : 0) |
+                       (down[c+radius] >= cval ? 8   : 0) |
+                       (down[c]        >= cval ? 4   : 0) |
+                       (down[c-radius] >= cval ? 2   : 0) |
+                       (mid[c-radius]  >= cval ? 1   : 0)];
+    }
+}
+
+static Mat toContinuousFloat(const Mat &src)
+{
+    Mat m;
+    src.convertTo(m, CV_32F);
+    if (!m.isContinuous()) m = m.clone();
+    assert(m.channels() == 1);
+    return m;
+}
+
+Mat LBPUtils::codes(const Mat &src, int radius, const uchar lut[256], uchar null)
+{
+    const Mat m = toContinuousFloat(src);
+    Mat n(m.rows, m.cols, CV_8UC1);
+    const float *p = m.ptr<float>();
+    for (int r=0; r<m.rows; r++)
+        codeRow(p, m.rows, m.cols, r, radius, lut, null, n.ptr(r));
+    return n;
+}
@@ -0,0 +1,32 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef LBPUTILS_LBPUTILS_H
+#define LBPUTILS_LBPUTILS_H
+
+#include <opencv2/core/core.hpp>
+
+namespace LBPUtils
+{
+    // Map raw 8-neighbor patterns to pattern ids, returns the id shared by patterns with more than maxTransitions transitions
+    uchar makeLUT(uchar lut[256], int maxTransitions, bool rotationInvariant);
+
+    // Pattern ids of a single channel image, pixels within radius of the border get the null id
+    cv::Mat codes(const cv::Mat &src, int radius, const uchar lut[256], uchar null);
+}
+
+#endif // LBPUTILS_LBPUTILS_H
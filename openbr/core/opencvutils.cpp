@@ -458,6 +458,62 @@ bool OpenCVUtils::overlaps(const QList<Rect> &posRects, const Rect &negRect, dou
     return false;
 }
 
+// Adds (or removes) one row of codes to the per-column histograms
+static void accumulateRow(const uchar *row, int cols, int bins, int delta, int *columns)
+{
+    for (int c=0; c<cols; c++)
+        if (row[c] < bins)
+            columns[c*bins + row[c]] += delta;
+}
+
+QList<Mat> OpenCVUtils::regionHistograms(const Mat &codes, int bins, const Size &region, const Size &step)
+{
+    if (codes.type() != CV_8UC1)
+        qFatal("Expected CV_8UC1 codes.");
+
+    const int nx = (codes.cols >= region.width) ? (codes.cols - region.width) / step.width + 1 : 0;
+    const int ny = (codes.rows >= region.height) ? (codes.rows - region.height) / step.height + 1 : 0;
+
+    // Column histograms over rows [top, bottom), slid down the image one band of regions at a time
+    QVector<int> columns(codes.cols * bins, 0);
+    QVector<int> counts(nx * ny * bins, 0);
+    int top = 0, bottom = 0;
+    for (int yi=0; yi<ny; yi++) {
+        const int y = yi * step.height;
+        for (; top < y; top++)
+            if (top < bottom)
+                accumulateRow(codes.ptr<uchar>(top), codes.cols, bins, -1, columns.data());
+        for (bottom = std::max(bottom, top); bottom < y + region.height; bottom++)
+            accumulateRow(codes.ptr<uchar>(bottom), codes.cols, bins, 1, columns.data());
+
+        // Likewise slide a window of columns across the band
+        QVector<int> window(bins, 0);
+        int left = 0, right = 0;
+        for (int xi=0; xi<nx; xi++) {
+            const int x = xi * step.width;
+            for (; left < x; left++)
+                if (left < right)
+                    for (int b=0; b<bins; b++)
+                        window[b] -= columns[left*bins + b];
+            for (right = std::max(right, left); right < x + region.width; right++)
+                for (int b=0; b<bins; b++)
+                    window[b] += columns[right*bins + b];
+            memcpy(counts.data() + (xi * ny + yi) * bins, window.constData(), bins * sizeof(int));
+        }
+    }
+
+    QList<Mat> histograms;
+    for (int i=0; i<nx*ny; i++) {
+        Mat hist(1, bins, CV_32FC1);
+        const int *regionCounts = counts.constData() + i * bins;
+        float *h = hist.ptr<float>();
+        for (int b=0; b<bins; b++)
+            h[b] = regionCounts[b];
+        histograms.append(hist);
+    }
+    return histograms;
+}
+
 // class for grouping object candidates, detected by Cascade Classifier, HOG etc.
 // instance of the class is to be passed to cv::partition (see cxoperations.hpp)
 class SimilarRects
@@ -107,6 +107,9 @@ namespace OpenCVUtils
     enum Axis { X = 0, Y = 1, Both = -1 };
 
     // Misc
+    // Histograms of CV_8UC1 codes in [0, bins) over a grid of rectangular regions, in the same order as RectRegionsTransform.
+    // Histograms are 1 x bins CV_32FC1 rows, accumulated by sliding column histograms rather than visiting each region's pixels.
+    QList<cv::Mat> regionHistograms(const cv::Mat &codes, int bins, const cv::Size &region, const cv::Size &step);
     void group(QList<cv::Rect> &rects, QList<float> &confidences, float confidenceThreshold, int minNeighbors, float epsilon, bool useMax=false, QList<int> *maxIndices=NULL);
     void pad(const br::Template &src, br::Template &dst, bool padMat, const QMarginsF &padding, bool padPoints, bool padRects, int border=0, int value=0);
     void pad(const br::TemplateList &src, br::TemplateList &dst, bool padMat, const QMarginsF &padding, bool padPoints, bool padRects, int border=0, int value=0);
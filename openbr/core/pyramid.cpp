@@ -0,0 +1,215 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QHash>
+#include <QMutex>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "openbr/core/pyramid.h"
+
+using namespace cv;
+
+namespace br
+{
+
+namespace
+{
+
+struct CachedSource
+{
+    Template source; // Keeps the source buffers alive so their addresses can't be reused by another image while cached
+    int levels;
+    qint64 bytes;
+};
+
+struct CachedLevel
+{
+    QByteArray sourceKey;
+    Template level;
+    qint64 bytes;
+    quint64 lastUse;
+};
+
+static qint64 bytesOf(const Template &t)
+{
+    qint64 bytes = 0;
+    foreach (const Mat &m, t)
+        bytes += qint64(m.total() * m.elemSize());
+    return bytes;
+}
+
+// Pinned sources are charged against the capacity once, however many of their levels are cached
+class LevelCache
+{
+    QMutex mutex;
+    QHash<QByteArray, CachedSource> sources;
+    QHash<QByteArray, CachedLevel> levels;
+    qint64 bytes;
+    quint64 clock;
+
+public:
+    LevelCache() : bytes(0), clock(0) {}
+
+    bool find(const QByteArray &key, Template *level)
+    {
+        QMutexLocker locker(&mutex);
+        QHash<QByteArray, CachedLevel>::iterator it = levels.find(key);
+        if (it == levels.end())
+            return false;
+        it->lastUse = ++clock;
+        *level = it->level;
+        return true;
+    }
+
+    void insert(const QByteArray &key, const QByteArray &sourceKey, const Template &source, const Template &level)
+    {
+        const qint64 capacity = qint64(Globals->file.get<int>("pyramidCache", 128)) << 20;
+
+        CachedLevel cached;
+        cached.sourceKey = sourceKey;
+        cached.level = level;
+        cached.bytes = bytesOf(level);
+
+        QMutexLocker locker(&mutex);
+        // Another thread may have built the same level concurrently
+        if (levels.contains(key))
+            return;
+
+        QHash<QByteArray, CachedSource>::iterator it = sources.find(sourceKey);
+        const qint64 sourceBytes = (it == sources.end()) ? bytesOf(source) : 0;
+        if (cached.bytes + sourceBytes > capacity)
+            return;
+
+        if (it == sources.end()) {
+            CachedSource cachedSource;
+            cachedSource.source = source;
+            cachedSource.levels = 0;
+            cachedSource.bytes = sourceBytes;
+            it = sources.insert(sourceKey, cachedSource);
+            bytes += sourceBytes;
+        }
+        it->levels++;
+
+        cached.lastUse = ++clock;
+        levels.insert(key, cached);
+        bytes += cached.bytes;
+
+        // Evict the least recently used levels, releasing their source along with its last level
+        while (bytes > capacity) {
+            QHash<QByteArray, CachedLevel>::iterator oldest = levels.begin();
+            for (QHash<QByteArray, CachedLevel>::iterator candidate = levels.begin(); candidate != levels.end(); ++candidate)
+                if (candidate->lastUse < oldest->lastUse)
+                    oldest = candidate;
+
+            QHash<QByteArray, CachedSource>::iterator pinned = sources.find(oldest->sourceKey);
+            if (--pinned->levels == 0) {
+                bytes -= pinned->bytes;
+                sources.erase(pinned);
+            }
+            bytes -= oldest->bytes;
+            levels.erase(oldest);
+        }
+    }
+};
+
+static LevelCache cache;
+
+// Identifies a source image by its buffers, which the cache pins while it holds a level of them
+static QByteArray sourceKey(const Template &src)
+{
+    QByteArray key = src.file.name.toUtf8();
+    foreach (const Mat &m, src)
+        key += QString("|%1:%2x%3:%4:%5").arg(QString::number(quintptr(m.data)), QString::number(m.rows), QString::number(m.cols),
+                                               QString::number(m.type()), QString::number(m.step[0])).toUtf8();
+    return key;
+}
+
+struct ScaleBuilder : public FeaturePyramid::Builder
+{
+    int interpolation;
+
+    ScaleBuilder(int interpolation) : interpolation(interpolation) {}
+
+    Template build(const Template &src, const Size &size) const
+    {
+        Template dst(src.file);
+        foreach (const Mat &m, src) {
+            Mat scaled;
+            resize(m, scaled, size, 0, 0, interpolation);
+            dst.append(scaled);
+        }
+        return dst;
+    }
+};
+
+struct PreprocessBuilder : public FeaturePyramid::Builder
+{
+    const Classifier *classifier;
+
+    PreprocessBuilder(const Classifier *classifier) : classifier(classifier) {}
+
+    Template build(const Template &src, const Size &size) const
+    {
+        return classifier->preprocess(FeaturePyramid::scaled(src, size));
+    }
+};
+
+} // namespace
+
+Template FeaturePyramid::level(const Template &src, const Size &size, const QByteArray &key, const Builder &builder)
+{
+    // Images without buffers of their own can't be identified
+    if (src.isEmpty() || !src.first().data || !src.first().refcount)
+        return builder.build(src, size);
+
+    const QByteArray srcKey = sourceKey(src);
+    const QByteArray levelKey = srcKey + QString("|%1x%2|").arg(QString::number(size.width), QString::number(size.height)).toUtf8() + key;
+
+    Template dst;
+    if (cache.find(levelKey, &dst))
+        return dst;
+
+    dst = builder.build(src, size);
+    cache.insert(levelKey, srcKey, src, dst);
+    return dst;
+}
+
+Template FeaturePyramid::scaled(const Template &src, const Size &size, int interpolation)
+{
+    return level(src, size, "Scale" + QByteArray::number(interpolation), ScaleBuilder(interpolation));
+}
+
+Template FeaturePyramid::preprocessed(const Template &src, const Size &size, const Classifier *classifier, const QByteArray &fingerprint)
+{
+    return level(src, size, "Preprocess" + fingerprint, PreprocessBuilder(classifier));
+}
+
+QByteArray FeaturePyramid::fingerprint(const Classifier *classifier)
+{
+    // preprocess() is delegated to the representation, directly or through the first stage of a cascade
+    const QObject *object = classifier;
+    while (object) {
+        if (const Representation *representation = object->property("representation").value<Representation*>())
+            return representation->description(true).toUtf8();
+
+        const QList<Classifier*> stages = object->property("stages").value< QList<Classifier*> >();
+        object = stages.isEmpty() ? NULL : stages.first();
+    }
+
+    return classifier->description(true).toUtf8();
+}
+
+} // namespace br
@@ -0,0 +1,56 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_PYRAMID_H
+#define BR_PYRAMID_H
+
+#include <QByteArray>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+// Process-wide cache of image pyramid levels, shared by every detector that
+// searches the same source image at the same scale.
+// Levels are shared, callers must not modify the returned matrices in place.
+// The cache size in megabytes is read from the "pyramidCache" global (default 128).
+namespace FeaturePyramid
+{
+    // Computes one level of the pyramid from the full resolution source
+    struct Builder
+    {
+        virtual ~Builder() {}
+        virtual Template build(const Template &src, const cv::Size &size) const = 0;
+    };
+
+    // The level of src at size identified by key, built on a cache miss
+    Template level(const Template &src, const cv::Size &size, const QByteArray &key, const Builder &builder);
+
+    // Every channel of src resized to size
+    Template scaled(const Template &src, const cv::Size &size, int interpolation = cv::INTER_AREA);
+
+    // classifier->preprocess() applied to scaled(src, size)
+    Template preprocessed(const Template &src, const cv::Size &size, const Classifier *classifier, const QByteArray &fingerprint);
+
+    // Identifies the output of classifier->preprocess() by the description of the representation it delegates to,
+    // classifiers with the same fingerprint share preprocessed levels
+    QByteArray fingerprint(const Classifier *classifier);
+}
+
+} // namespace br
+
+#endif // BR_PYRAMID_H
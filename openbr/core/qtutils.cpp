@@ -26,6 +26,7 @@
 #include <QRegExp>
 #include <QRegularExpression>
 #include <QStack>
+#include <QtConcurrent>
 #include <QUrl>
 #include <QJsonArray>
 #include <openbr/openbr_plugin.h>
@@ -574,15 +575,50 @@ QString getAbsolutePath(const QString &filename)
     return QFileInfo(filename).absoluteFilePath();
 }
 
-const int base_block = 100000000;
+// Small enough that a model spans many blocks to (de)compress in parallel
+const int base_block = 1 << 22;
+const quint32 indexed_magic = 0x42524243; // "BRBC"
+const quint32 indexed_version = 1;
+const qint64 header_size = 4 * sizeof(quint32);
+const qint64 trailer_size = sizeof(quint64) + 2 * sizeof(quint32);
+
+static QByteArray compressBlock(const QByteArray &block, int level)
+{
+    return qCompress(block, level);
+}
+
+static QByteArray decompressBlock(const QByteArray &block)
+{
+    return qUncompress(block);
+}
 
 BlockCompression::BlockCompression(QIODevice *_basis)
 {
-    blockSize = base_block;
+    init();
     setBasis(_basis);
 }
 
-BlockCompression::BlockCompression() { blockSize = base_block;};
+BlockCompression::BlockCompression() { init(); }
+
+BlockCompression::~BlockCompression()
+{
+    // basis may already be gone, so only wait for outstanding work here
+    foreach (QFuture<QByteArray> future, pendingReads)
+        future.waitForFinished();
+    foreach (QFuture<QByteArray> future, pendingWrites)
+        future.waitForFinished();
+}
+
+void BlockCompression::init()
+{
+    blockSize = base_block;
+    compressionLevel = Globals ? Globals->modelCompression : -1;
+    basis = NULL;
+    indexed = false;
+    codec = Zlib;
+    currentBlock = -1;
+    mapped = NULL;
+}
 
 bool BlockCompression::open(QIODevice::OpenMode mode)
 {
@@ -596,15 +632,22 @@ bool BlockCompression::open(QIODevice::OpenMode mode)
     blockWriter.setDevice(basis);
 
     if (mode & QIODevice::WriteOnly) {
+        indexed = true;
+        codec = (compressionLevel == 0) ? Stored : Zlib;
+        blocks.clear();
+        blockWriter << indexed_magic << indexed_version << quint32(codec) << quint32(blockSize);
         precompressedBlockWriter.open(QIODevice::WriteOnly);
     }
     else if (mode & QIODevice::ReadOnly) {
+        quint32 block_size;
+        blockReader >> block_size;
+        if (block_size == indexed_magic)
+            return openIndexed();
 
-        // Read an initial compressed block from the underlying QIODevice,
+        // Legacy file, read the initial compressed block from the underlying QIODevice,
         // decompress, and set up a reader on it
+        indexed = false;
         QByteArray compressedBlock;
-        quint32 block_size;
-        blockReader >> block_size;
         compressedBlock.resize(block_size);
         int read_count = blockReader.readRawData(compressedBlock.data(), block_size);
         if (read_count != int(block_size))
@@ -619,20 +662,97 @@ bool BlockCompression::open(QIODevice::OpenMode mode)
     return true;
 }
 
+bool BlockCompression::openIndexed()
+{
+    indexed = true;
+    quint32 version, codecId, size;
+    blockReader >> version >> codecId >> size;
+    if (version != indexed_version)
+        qFatal("Unsupported block compression version %d", version);
+    if (codecId > Zlib)
+        qFatal("Unsupported block compression codec %d", codecId);
+    codec = Codec(codecId);
+    blockSize = size;
+
+    // The trailer locates the block index
+    if (!basis->seek(basis->size() - trailer_size))
+        qFatal("Failed to seek to block index");
+    quint64 indexOffset;
+    quint32 count, magic;
+    blockReader >> indexOffset >> count >> magic;
+    if (magic != indexed_magic)
+        qFatal("Missing block index, the file may be truncated");
+
+    if (!basis->seek(indexOffset))
+        qFatal("Failed to seek to block index");
+    blocks.clear();
+    blocks.reserve(count);
+    qint64 offset = header_size, start = 0;
+    for (quint32 i=0; i<count; i++) {
+        Block block;
+        blockReader >> block.encodedSize >> block.size;
+        block.offset = offset;
+        block.start = start;
+        offset += block.encodedSize;
+        start += block.size;
+        blocks.append(block);
+    }
+    if (blockReader.status() != QDataStream::Ok)
+        qFatal("Failed to read block index");
+
+    // Use blocks in place rather than reading them into memory
+    QFile *file = qobject_cast<QFile*>(basis);
+    if (file)
+        mapped = file->map(0, file->size());
+
+    if (!blocks.isEmpty())
+        loadBlock(0);
+    return true;
+}
+
+// Wait for outstanding (de)compression and drop the mapping, if any
+void BlockCompression::release()
+{
+    foreach (QFuture<QByteArray> future, pendingReads)
+        future.waitForFinished();
+    pendingReads.clear();
+    foreach (QFuture<QByteArray> future, pendingWrites)
+        future.waitForFinished();
+    pendingWrites.clear();
+
+    decompressedBlockReader.close();
+    decompressedBlock.clear();
+
+    QFile *file = qobject_cast<QFile*>(basis);
+    if (mapped && file)
+        file->unmap(mapped);
+    mapped = NULL;
+    currentBlock = -1;
+}
+
 void BlockCompression::close()
 {
     // flush output buffer, since we may have a partial block which hasn't been 
     // written to disk yet.
     if ((openMode() & QIODevice::WriteOnly) && precompressedBlockWriter.isOpen()) {
-        QByteArray compressedBlock = qCompress(precompressedBlockWriter.buffer());
+        if (precompressedBlockWriter.pos() > 0)
+            submitBlock();
         precompressedBlockWriter.close();
-
-        quint32 bsize=  compressedBlock.size();
-        blockWriter << bsize;
-        blockWriter.writeRawData(compressedBlock.constData(), compressedBlock.size());
+        while (!pendingWrites.isEmpty())
+            flushWrite();
+
+        // Block index followed by the trailer that locates it
+        const quint64 indexOffset = basis->pos();
+        foreach (const Block &block, blocks)
+            blockWriter << block.encodedSize << block.size;
+        blockWriter << indexOffset << quint32(blocks.size()) << indexed_magic;
     }
+
+    release();
+
     // close the underlying device.
     basis->close();
+    QIODevice::close();
 }
 
 void BlockCompression::setBasis(QIODevice *_basis)
@@ -642,6 +762,49 @@ void BlockCompression::setBasis(QIODevice *_basis)
     blockWriter.setDevice(basis);
 }
 
+// The encoded bytes of a block, referenced in place when the file is mapped
+QByteArray BlockCompression::encodedBlock(int index)
+{
+    const Block &block = blocks[index];
+    if (mapped)
+        return QByteArray::fromRawData((const char*) mapped + block.offset, block.encodedSize);
+
+    if (!basis->seek(block.offset))
+        qFatal("Failed to seek to block %d", index);
+    QByteArray encoded = basis->read(block.encodedSize);
+    if (encoded.size() != int(block.encodedSize))
+        qFatal("Bad read on block %d", index);
+    return encoded;
+}
+
+// Make blocks[index] the current block, and start decompressing the blocks
+// after it so they are ready by the time the reader gets to them
+void BlockCompression::loadBlock(int index)
+{
+    if (codec == Stored) {
+        decompressedBlock = encodedBlock(index);
+    } else {
+        // Drop read-ahead for blocks behind us after a backwards seek
+        foreach (int i, pendingReads.keys())
+            if (i < index)
+                pendingReads.take(i).waitForFinished();
+
+        const int readAhead = qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+        for (int i=index; i<qMin(index + readAhead, blocks.size()); i++)
+            if (!pendingReads.contains(i))
+                pendingReads.insert(i, QtConcurrent::run(decompressBlock, encodedBlock(i)));
+
+        decompressedBlock = pendingReads.take(index).result();
+        if (decompressedBlock.size() != int(blocks[index].size))
+            qFatal("Failed to decompress block %d", index);
+    }
+
+    currentBlock = index;
+    decompressedBlockReader.close();
+    decompressedBlockReader.setBuffer(&decompressedBlock);
+    decompressedBlockReader.open(QIODevice::ReadOnly);
+}
+
 // read from current decompressed block, if out of space, read and decompress another
 // block from basis
 qint64 BlockCompression::readData(char *data, qint64 remaining)
@@ -659,6 +822,13 @@ qint64 BlockCompression::readData(char *data, qint64 remaining)
 
         // need a new block if we didn't get enough bytes from the previous read
         if (remaining > 0) {
+            if (indexed) {
+                if (currentBlock + 1 >= blocks.size())
+                    break;
+                loadBlock(currentBlock + 1);
+                continue;
+            }
+
             QByteArray compressedBlock;
 
             // read the size of the next block
@@ -680,6 +850,9 @@ qint64 BlockCompression::readData(char *data, qint64 remaining)
         }
     }
 
+    if (indexed)
+        return read;
+
     bool condition = blockReader.atEnd() && !basis->isReadable() ;
     if (condition)
         qWarning("Returning -1 from read");
@@ -689,7 +862,81 @@ qint64 BlockCompression::readData(char *data, qint64 remaining)
 
 bool BlockCompression::isSequential() const
 {
-    return true;
+    // Only indexed files opened for reading support random access
+    return !indexed || (openMode() & QIODevice::WriteOnly);
+}
+
+qint64 BlockCompression::size() const
+{
+    if (isSequential())
+        return QIODevice::size();
+    return blocks.isEmpty() ? 0 : blocks.last().start + blocks.last().size;
+}
+
+bool BlockCompression::seek(qint64 pos)
+{
+    if (isSequential())
+        return QIODevice::seek(pos);
+    if ((pos < 0) || (pos > size()))
+        return false;
+
+    QIODevice::seek(pos);
+    if (blocks.isEmpty())
+        return true;
+
+    // Find the last block starting at or before pos
+    int lo = 0, hi = blocks.size() - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi + 1) / 2;
+        if (blocks[mid].start <= pos) lo = mid;
+        else                          hi = mid - 1;
+    }
+
+    if (lo != currentBlock)
+        loadBlock(lo);
+    return decompressedBlockReader.seek(pos - blocks[lo].start);
+}
+
+// Hand the full write buffer off to be compressed on the thread pool
+void BlockCompression::submitBlock()
+{
+    const QByteArray block = precompressedBlockWriter.buffer();
+    if (block.isEmpty())
+        qFatal("serialized empty compressed block (?)");
+
+    Block info;
+    info.offset = info.start = 0; // Only needed when reading
+    info.encodedSize = 0;
+    info.size = block.size();
+    blocks.append(info);
+
+    if (codec == Stored) {
+        writeBlock(blocks.size()-1, block);
+    } else {
+        pendingWrites.append(QtConcurrent::run(compressBlock, block, compressionLevel));
+
+        // Bound the number of blocks held in memory while waiting to be written
+        while (pendingWrites.size() > 2 * QThreadPool::globalInstance()->maxThreadCount())
+            flushWrite();
+    }
+
+    precompressedBlockWriter.close();
+    precompressedBlockWriter.open(QIODevice::WriteOnly);
+}
+
+// Write the oldest compressed block, blocks must reach basis in order
+void BlockCompression::flushWrite()
+{
+    const int index = blocks.size() - pendingWrites.size();
+    writeBlock(index, pendingWrites.takeFirst().result());
+}
+
+void BlockCompression::writeBlock(int index, const QByteArray &encoded)
+{
+    blocks[index].encodedSize = encoded.size();
+    int write_count = blockWriter.writeRawData(encoded.constData(), encoded.size());
+    if (write_count != encoded.size())
+        qFatal("Didn't write enough data");
 }
 
 qint64 BlockCompression::writeData(const char *data, qint64 remaining)
@@ -719,23 +966,8 @@ qint64 BlockCompression::writeData(const char *data, qint64 remaining)
         if (data > endPoint)
             qFatal("Wrote past the end");
 
-        if (remaining > 0) {
-            QByteArray compressedBlock = qCompress(precompressedBlockWriter.buffer(), -1);
-
-            if (precompressedBlockWriter.buffer().size() != 0) {
-                quint32 block_size = compressedBlock.size();
-                blockWriter << block_size;
-
-                int write_count = blockWriter.writeRawData(compressedBlock.constData(), block_size);
-                if (write_count != int(block_size))
-                    qFatal("Didn't write enough data");
-            }
-            else
-                qFatal("serialized empty compressed block (?)");
-
-            precompressedBlockWriter.close();
-            precompressedBlockWriter.open(QIODevice::WriteOnly);
-        }
+        if (remaining > 0)
+            submitBlock();
     }
 
     if (written != initial)
@@ -749,6 +981,5 @@ qint64 BlockCompression::writeData(const char *data, qint64 remaining)
 }
 
 
-
 }  // namespace QtUtils
 
@@ -105,12 +105,23 @@ namespace QtUtils
     float area(const QRectF &r);
     float overlap(const QRectF &r, const QRectF &s);
     
+    // Block compressed QIODevice used for model files.
+    // Blocks are compressed and decompressed on the global thread pool, and an
+    // index at the end of the file allows random access. A compressionLevel of
+    // zero stores blocks uncompressed, and reading such a file from a QFile
+    // memory maps it instead of copying. Files written by earlier versions (a
+    // bare sequence of size-prefixed qCompress blocks) are still readable, but
+    // only sequentially.
     class BlockCompression : public QIODevice
     {
     public:
+        enum Codec { Stored = 0, Zlib = 1 };
+
         BlockCompression(QIODevice *_basis);
         BlockCompression();
+        ~BlockCompression();
         int blockSize;
+        int compressionLevel; // zlib level, 0 to store blocks uncompressed, -1 for the zlib default
         QIODevice *basis;
 
         bool open(QIODevice::OpenMode mode);
@@ -128,12 +139,39 @@ namespace QtUtils
         qint64 readData(char *data, qint64 remaining);
 
         bool isSequential() const;
+        qint64 size() const;
+        bool seek(qint64 pos);
 
         // write to a QByteArray, when max block sized is reached, compress and write
         // it to basis
         QBuffer precompressedBlockWriter;
         QDataStream blockWriter;
         qint64 writeData(const char *data, qint64 remaining);
+
+    private:
+        struct Block
+        {
+            qint64 offset; // Position of the encoded block in basis
+            qint64 start; // Position of the decoded block in the uncompressed stream
+            quint32 encodedSize, size;
+        };
+
+        bool indexed; // False when reading a legacy file
+        Codec codec;
+        QList<Block> blocks;
+        int currentBlock;
+        uchar *mapped;
+        QMap<int, QFuture<QByteArray> > pendingReads; // Decompression read-ahead, by block index
+        QList<QFuture<QByteArray> > pendingWrites; // Compression jobs, in file order
+
+        void init();
+        bool openIndexed();
+        void release();
+        QByteArray encodedBlock(int index);
+        void loadBlock(int index);
+        void submitBlock();
+        void flushWrite();
+        void writeBlock(int index, const QByteArray &encoded);
     };
 }
 
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrentRun>
 #include <openbr/openbr_plugin.h>
 
 #include "core/bee.h"
@@ -26,6 +28,7 @@
 #include "plugins/openbr_internal.h"
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/highgui/highgui_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
 
 using namespace br;
 
@@ -335,6 +338,41 @@ br_template br_load_img(const char *data, int len)
     return (br_template)tmpl;
 }
 
+// Wraps caller-owned pixels, only formats the pipeline can't consume directly are converted
+static cv::Mat wrapRawImage(unsigned char *data, int rows, int cols, int stride, int format)
+{
+    switch (format) {
+      case BR_PIXEL_GRAY:
+        return cv::Mat(rows, cols, CV_8UC1, data, stride);
+      case BR_PIXEL_BGR:
+        return cv::Mat(rows, cols, CV_8UC3, data, stride);
+      case BR_PIXEL_RGB: {
+        cv::Mat bgr;
+        cv::cvtColor(cv::Mat(rows, cols, CV_8UC3, data, stride), bgr, CV_RGB2BGR);
+        return bgr;
+      }
+      case BR_PIXEL_BGRA: {
+        cv::Mat bgr;
+        cv::cvtColor(cv::Mat(rows, cols, CV_8UC4, data, stride), bgr, CV_BGRA2BGR);
+        return bgr;
+      }
+      case BR_PIXEL_RGBA: {
+        cv::Mat bgr;
+        cv::cvtColor(cv::Mat(rows, cols, CV_8UC4, data, stride), bgr, CV_RGBA2BGR);
+        return bgr;
+      }
+      default:
+        qFatal("Unrecognized pixel format %d.", format);
+    }
+    return cv::Mat();
+}
+
+br_template br_load_img_raw(unsigned char *data, int rows, int cols, int stride, int format)
+{
+    Template *tmpl = new Template(wrapRawImage(data, rows, cols, stride, format));
+    return (br_template)tmpl;
+}
+
 unsigned char *br_unload_img(br_template tmpl)
 {
     Template *t = reinterpret_cast<Template*>(tmpl);
@@ -424,6 +462,17 @@ void br_enroll_template_list(br_template_list tl)
     Enroll(*realTL);
 }
 
+br_template_list br_enroll_img_raw_batch(int num_images, unsigned char *data[], const int rows[], const int cols[], const int strides[], int format)
+{
+    TemplateList *tl = new TemplateList();
+    tl->reserve(num_images);
+    for (int i=0; i<num_images; i++)
+        tl->append(Template(wrapRawImage(data[i], rows[i], cols[i], strides[i], format)));
+    if (!tl->isEmpty())
+        Enroll(*tl);
+    return (br_template_list)tl;
+}
+
 br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query)
 {
     TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
@@ -433,6 +482,94 @@ br_matrix_output br_compare_template_lists(br_template_list target, br_template_
     return (br_matrix_output)output;
 }
 
+// Writes scores straight into a caller-owned, row-major (query x target) buffer
+class BufferOutput : public Output
+{
+    float *scores;
+
+public:
+    // Not made through the Factory, so properties are reset here rather than by Object::init()
+    BufferOutput(float *scores) : scores(scores)
+    {
+        reset_blockRows();
+        reset_blockCols();
+    }
+
+private:
+    void set(float value, int i, int j)
+    {
+        scores[qint64(i)*targetFiles.size() + j] = value;
+    }
+};
+
+void br_compare_template_lists_into(br_template_list target, br_template_list query, float *scores)
+{
+    TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
+    TemplateList *queryTL = reinterpret_cast<TemplateList*>(query);
+    BufferOutput output(scores);
+    output.initialize(targetTL->files(), queryTL->files());
+    CompareTemplateLists(*targetTL, *queryTL, &output);
+}
+
+struct SearchJob
+{
+    const Distance *distance;
+    const TemplateList *targets;
+    const TemplateList *queries;
+    int k;
+    float *scores;
+    int *indices;
+};
+
+// Orders target indices by descending similarity, ties broken by index
+struct MoreSimilar
+{
+    const QList<float> &similarities;
+    MoreSimilar(const QList<float> &similarities) : similarities(similarities) {}
+    bool operator()(int a, int b) const
+    {
+        return (similarities[a] > similarities[b]) || ((similarities[a] == similarities[b]) && (a < b));
+    }
+};
+
+static void searchQuery(const SearchJob &job, int query)
+{
+    const QList<float> similarities = job.distance->compare(*job.targets, job.queries->at(query));
+
+    QVector<int> order(similarities.size());
+    for (int i=0; i<order.size(); i++)
+        order[i] = i;
+
+    const int found = std::min(job.k, order.size());
+    std::partial_sort(order.begin(), order.begin() + found, order.end(), MoreSimilar(similarities));
+
+    float *scores = job.scores + qint64(query)*job.k;
+    int *indices = job.indices + qint64(query)*job.k;
+    for (int i=0; i<job.k; i++) {
+        scores[i] = (i < found) ? similarities[order[i]] : -std::numeric_limits<float>::max();
+        indices[i] = (i < found) ? order[i] : -1;
+    }
+}
+
+void br_search_template_lists(br_template_list target, br_template_list query, int k, float *scores, int *indices)
+{
+    QSharedPointer<Distance> distance = Distance::fromAlgorithm(Globals->algorithm);
+
+    SearchJob job;
+    job.distance = distance.data();
+    job.targets = reinterpret_cast<TemplateList*>(target);
+    job.queries = reinterpret_cast<TemplateList*>(query);
+    job.k = k;
+    job.scores = scores;
+    job.indices = indices;
+
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<job.queries->size(); i++)
+        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(searchQuery, job, i));
+        else                                                               searchQuery(job, i);
+    futures.waitForFinished();
+}
+
 float br_get_matrix_output_at(br_matrix_output output, int row, int col)
 {
     MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
@@ -132,8 +132,17 @@ typedef void* br_template_list;
 typedef void* br_gallery;
 typedef void* br_matrix_output;
 
+// Pixel layouts accepted by br_load_img_raw, BR_PIXEL_GRAY and BR_PIXEL_BGR are wrapped without copying
+enum br_pixel_format { BR_PIXEL_GRAY = 0,
+                       BR_PIXEL_BGR = 1,
+                       BR_PIXEL_RGB = 2,
+                       BR_PIXEL_BGRA = 3,
+                       BR_PIXEL_RGBA = 4 };
+
 BR_EXPORT br_template br_load_img(const char *data, int len);
 
+BR_EXPORT br_template br_load_img_raw(unsigned char *data, int rows, int cols, int stride, int format);
+
 BR_EXPORT unsigned char* br_unload_img(br_template tmpl);
 
 BR_EXPORT br_template_list br_template_list_from_buffer(const char *buf, int len);
@@ -162,8 +171,14 @@ BR_EXPORT br_template_list br_enroll_template(br_template tmpl);
 
 BR_EXPORT void br_enroll_template_list(br_template_list tl);
 
+BR_EXPORT br_template_list br_enroll_img_raw_batch(int num_images, unsigned char *data[], const int rows[], const int cols[], const int strides[], int format);
+
 BR_EXPORT br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query);
 
+BR_EXPORT void br_compare_template_lists_into(br_template_list target, br_template_list query, float *scores);
+
+BR_EXPORT void br_search_template_lists(br_template_list target, br_template_list query, int k, float *scores, int *indices);
+
 BR_EXPORT float br_get_matrix_output_at(br_matrix_output output, int row, int col);
 
 BR_EXPORT br_template br_get_template(br_template_list tl, int index);
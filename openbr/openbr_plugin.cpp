@@ -16,6 +16,7 @@
 
 #include <QCoreApplication>
 #include <QCryptographicHash>
+#include <QElapsedTimer>
 #include <QFutureSynchronizer>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -26,6 +27,7 @@
 #include <QRect>
 #include <QRegExp>
 #include <QThreadPool>
+#include <QThreadStorage>
 #include <QtConcurrentRun>
 #include <algorithm>
 #include <iostream>
@@ -96,9 +98,41 @@ void File::append(const File &other)
         }
     }
     append(other.m_metadata);
+    if (other.m_hasPoints) {
+        m_metadata.remove("Points");
+        m_points = other.m_points;
+        m_hasPoints = true;
+    }
+    if (other.m_hasRects) {
+        m_metadata.remove("Rects");
+        m_rects = other.m_rects;
+        m_hasRects = true;
+    }
     fte = fte | other.fte;
 }
 
+QStringList File::localKeys() const
+{
+    QStringList keys = m_metadata.keys();
+    if (m_hasPoints || m_hasRects) {
+        if (m_hasPoints) keys.append("Points");
+        if (m_hasRects) keys.append("Rects");
+        qSort(keys);
+    }
+    return keys;
+}
+
+QVariantMap File::localMetadata() const
+{
+    if (!m_hasPoints && !m_hasRects)
+        return m_metadata;
+
+    QVariantMap metadata = m_metadata;
+    if (m_hasPoints) metadata.insert("Points", value("Points"));
+    if (m_hasRects) metadata.insert("Rects", value("Rects"));
+    return metadata;
+}
+
 QList<File> File::split() const
 {
     if (name.isEmpty()) return QList<File>();
@@ -114,8 +148,8 @@ QList<File> File::split(const QString &separator) const
         // If file metadata is empty after this constructor, it means that this is the
         // file corresponding to *this.m_metadata, so we append its metadata to get
         // the correct functionality
-        if (file.m_metadata.isEmpty())
-            file.append(m_metadata);
+        if (file.m_metadata.isEmpty() && !file.m_hasPoints && !file.m_hasRects)
+            file.append(localMetadata());
         files.append(file);
     }
     return files;
@@ -138,7 +172,10 @@ QString File::resolved() const
 
 bool File::contains(const QString &key) const
 {
-    return m_metadata.contains(key) || Globals->contains(key) || key == "name";
+    return m_metadata.contains(key) ||
+           (m_hasPoints && (key == "Points")) ||
+           (m_hasRects && (key == "Rects")) ||
+           Globals->contains(key) || key == "name";
 }
 
 bool File::contains(const QStringList &keys) const
@@ -151,7 +188,27 @@ bool File::contains(const QStringList &keys) const
 
 QVariant File::value(const QString &key) const
 {
-    return m_metadata.contains(key) ? m_metadata.value(key) : (key == "name" ? name : Globals->property(qPrintable(key)));
+    QVariantMap::const_iterator it = m_metadata.find(key);
+    if (it != m_metadata.end())
+        return it.value();
+
+    if (m_hasPoints && (key == "Points")) {
+        QVariantList variants;
+        variants.reserve(m_points.size());
+        foreach (const QPointF &point, m_points)
+            variants.append(point);
+        return variants;
+    }
+
+    if (m_hasRects && (key == "Rects")) {
+        QVariantList variants;
+        variants.reserve(m_rects.size());
+        foreach (const QRectF &rect, m_rects)
+            variants.append(rect);
+        return variants;
+    }
+
+    return key == "name" ? QVariant(name) : Globals->value(key);
 }
 
 QVariant File::parse(const QString &value)
@@ -170,6 +227,47 @@ QVariant File::parse(const QString &value)
     return value;
 }
 
+// Points and rects are only stored natively when every element has the expected type
+void File::set(const QString &key, const QVariant &value)
+{
+    if ((key == "Points") || (key == "Rects")) {
+        const bool points = (key == "Points");
+        bool native = (value.type() == QVariant::List);
+        const QVariantList variants = native ? value.toList() : QVariantList();
+        foreach (const QVariant &variant, variants)
+            native = native && (points ? ((variant.type() == QVariant::PointF) || (variant.type() == QVariant::Point))
+                                       : ((variant.type() == QVariant::RectF) || (variant.type() == QVariant::Rect)));
+
+        if (native) {
+            m_metadata.remove(key);
+            if (points) {
+                m_points.clear();
+                foreach (const QVariant &variant, variants)
+                    m_points.append(variant.toPointF());
+                m_hasPoints = true;
+            } else {
+                m_rects.clear();
+                foreach (const QVariant &variant, variants)
+                    m_rects.append(variant.toRectF());
+                m_hasRects = true;
+            }
+            return;
+        }
+
+        if (points) { m_points.clear(); m_hasPoints = false; }
+        else        { m_rects.clear();  m_hasRects = false; }
+    }
+
+    m_metadata.insert(key, value);
+}
+
+void File::remove(const QString &key)
+{
+    m_metadata.remove(key);
+    if (key == "Points") { m_points.clear(); m_hasPoints = false; }
+    if (key == "Rects")  { m_rects.clear();  m_hasRects = false; }
+}
+
 void File::set(const QString &key, const QString &value)
 {
     if (value.startsWith('[') && value.endsWith(']')) {
@@ -193,7 +291,7 @@ bool File::getBool(const QString &key, bool defaultValue) const
 QList<QPointF> File::namedPoints() const
 {
     QList<QPointF> landmarks;
-    foreach (const QString &key, localMetadata().keys()) {
+    foreach (const QString &key, m_metadata.keys()) {
         const QVariant &variant = m_metadata[key];
         if (variant.canConvert<QPointF>()) {
             const QPointF point = variant.value<QPointF>();
@@ -206,31 +304,39 @@ QList<QPointF> File::namedPoints() const
 
 QList<QPointF> File::points() const
 {
+    if (m_hasPoints)
+        return m_points;
+
     QList<QPointF> points;
-    foreach (const QVariant &point, m_metadata["Points"].toList())
+    foreach (const QVariant &point, m_metadata.value("Points").toList())
         points.append(point.toPointF());
     return points;
 }
 
 void File::appendPoint(const QPointF &point)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
-    newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    if (!m_hasPoints) {
+        m_points = points();
+        m_metadata.remove("Points");
+        m_hasPoints = true;
+    }
+    m_points.append(point);
 }
 
 void File::appendPoints(const QList<QPointF> &points)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
-    foreach (const QPointF &point, points)
-        newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    if (!m_hasPoints) {
+        m_points = this->points();
+        m_metadata.remove("Points");
+        m_hasPoints = true;
+    }
+    m_points.append(points);
 }
 
 QList<QRectF> File::namedRects() const
 {
     QList<QRectF> rects;
-    foreach (const QString &key, localMetadata().keys()) {
+    foreach (const QString &key, m_metadata.keys()) {
         const QVariant &variant = m_metadata[key];
         if (variant.canConvert<QRectF>())
             rects.append(variant.value<QRectF>());
@@ -247,17 +353,23 @@ QList<QRectF> File::namedRects() const
 
 QList<QRectF> File::rects() const
 {
+    if (m_hasRects)
+        return m_rects;
+
     QList<QRectF> rects;
-    foreach (const QVariant &rect, m_metadata["Rects"].toList())
+    foreach (const QVariant &rect, m_metadata.value("Rects").toList())
         rects.append(rect.toRectF());
     return rects;
 }
 
 void File::appendRect(const QRectF &rect)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
-    newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    if (!m_hasRects) {
+        m_rects = rects();
+        m_metadata.remove("Rects");
+        m_hasRects = true;
+    }
+    m_rects.append(rect);
 }
 
 void File::appendRect(const cv::Rect &rect)
@@ -267,10 +379,12 @@ void File::appendRect(const cv::Rect &rect)
 
 void File::appendRects(const QList<QRectF> &rects)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
-    foreach (const QRectF &rect, rects)
-        newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    if (!m_hasRects) {
+        m_rects = this->rects();
+        m_metadata.remove("Rects");
+        m_hasRects = true;
+    }
+    m_rects.append(rects);
 }
 
 void File::appendRects(const QList<cv::Rect> &rects)
@@ -281,7 +395,7 @@ void File::appendRects(const QList<cv::Rect> &rects)
 QList<RotatedRect> File::namedRotatedRects() const
 {
     QList<RotatedRect> rects;
-    foreach (const QString &key, localMetadata().keys()) {
+    foreach (const QString &key, m_metadata.keys()) {
         const QVariant &variant = m_metadata[key];
         if (variant.canConvert<RotatedRect>())
             rects.append(variant.value<RotatedRect>());
@@ -293,6 +407,7 @@ QList<RotatedRect> File::namedRotatedRects() const
 void File::init(const QString &file)
 {
     fte = false;
+    m_hasPoints = m_hasRects = false;
     name = file;
 
     while (name.endsWith(']') || name.endsWith(')')) {
@@ -334,14 +449,20 @@ QDebug br::operator<<(QDebug dbg, const File &file)
 
 QDataStream &br::operator<<(QDataStream &stream, const File &file)
 {
-    File temp = file;
-    temp.set("FTE",QVariant::fromValue(file.fte));
-    return stream << temp.name << temp.m_metadata;
+    QVariantMap metadata = file.localMetadata();
+    metadata.insert("FTE", QVariant::fromValue(file.fte));
+    return stream << file.name << metadata;
 }
 
 QDataStream &br::operator>>(QDataStream &stream, File &file)
 {
-    stream >> file.name >> file.m_metadata;
+    QVariantMap metadata;
+    stream >> file.name >> metadata;
+    file.m_metadata.clear();
+    file.m_points.clear();
+    file.m_rects.clear();
+    file.m_hasPoints = file.m_hasRects = false;
+    file.append(metadata);
     file.fte = file.getBool("FTE", false);
     return stream;
 }
@@ -1179,9 +1300,32 @@ void Object::init(const File &file_)
 }
 
 /* Context - public methods */
-bool br::Context::contains(const QString &name)
+bool br::Context::contains(const QString &name) const
+{
+    return value(name).isValid();
+}
+
+QVariant br::Context::value(const QString &name) const
 {
-    return property(qPrintable(name)).isValid();
+    int index;
+    {
+        QReadLocker locker(&propertyIndexLock);
+        index = propertyIndices.value(name, -2);
+    }
+
+    if (index == -2) {
+        index = metaObject()->indexOfProperty(qPrintable(name));
+        QWriteLocker locker(&propertyIndexLock);
+        propertyIndices.insert(name, index);
+    }
+
+    if (index >= 0)
+        return metaObject()->property(index).read(this);
+
+    // Names set at runtime become dynamic properties, which aren't in the meta-object
+    if (dynamicPropertyNames().isEmpty())
+        return QVariant();
+    return property(qPrintable(name));
 }
 
 void br::Context::printStatus()
@@ -1680,20 +1824,82 @@ static void _project(const Transform *transform, const Template *src, Template *
     }
 }
 
-// Default project(TemplateList) calls project(Template) separately for each element
+static void _projectRange(const Transform *transform, const TemplateList *src, TemplateList *dst, int begin, int end)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i=begin; i<end; i++)
+        _project(transform, &src->at(i), &(*dst)[i]);
+    transform->recordProjectCost(timer.nsecsElapsed(), end - begin);
+}
+
+// Default project(TemplateList) calls project(Template) separately for each element,
+// grouping elements into chunks sized from the learned per-template cost
 void Transform::project(const TemplateList &src, TemplateList &dst) const
 {
     dst.reserve(src.size());
 
+    // Start from the source metadata, as operator() does
     for (int i=0; i<src.size(); i++)
-        dst.append(Template());
+        dst.append(Template(src[i].file));
+
+    if ((Globals->parallelism <= 1) || (dst.size() <= 1) || SerialProjectScope::active()) {
+        _projectRange(this, &src, &dst, 0, dst.size());
+        return;
+    }
+
+    const int chunkSize = projectChunkSize(dst.size());
     QFutureSynchronizer<void> futures;
-    for (int i=0; i<dst.size(); i++)
-        if ((Globals->parallelism > 1) && (dst.size() > 1)) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
-        else                                                _project(this, &src[i], &dst[i]);
+    for (int i=0; i<dst.size(); i+=chunkSize)
+        futures.addFuture(QtConcurrent::run(_projectRange, this, &src, &dst, i, std::min(i+chunkSize, dst.size())));
     futures.waitForFinished();
 }
 
+int Transform::projectChunkSize(int size) const
+{
+    // Keep several tasks per thread so templates of uneven cost still balance
+    const int tasks = 4 * std::max(1, abs(Globals->parallelism));
+    const int maxChunk = std::max(1, (size + tasks - 1) / tasks);
+
+    // Until the cost is known assume the transform is cheap
+    const int cost = projectCost.load();
+    if (cost <= 0)
+        return maxChunk;
+
+    // Aim for roughly a millisecond of work per task to amortize scheduling overhead
+    const qint64 targetNsecs = 1000000;
+    return int(std::max(qint64(1), std::min(qint64(maxChunk), targetNsecs / cost)));
+}
+
+void Transform::recordProjectCost(qint64 nsecs, int templates) const
+{
+    if (templates <= 0)
+        return;
+
+    const qint64 sample = std::max(qint64(1), std::min(qint64(std::numeric_limits<int>::max()), nsecs / templates));
+    const qint64 previous = projectCost.load();
+    // Exponential moving average, races between threads only lose a sample
+    projectCost.store(int(previous == 0 ? sample : (3*previous + sample) / 4));
+}
+
+static QThreadStorage<bool> serialProjectScope;
+
+SerialProjectScope::SerialProjectScope()
+{
+    previous = active();
+    serialProjectScope.setLocalData(true);
+}
+
+SerialProjectScope::~SerialProjectScope()
+{
+    serialProjectScope.setLocalData(previous);
+}
+
+bool SerialProjectScope::active()
+{
+    return serialProjectScope.hasLocalData() && serialProjectScope.localData();
+}
+
 TemplateEvent *Transform::getEvent(const QString &name)
 {
     foreach (Transform *child, getChildren<Transform>()) {
@@ -1772,6 +1978,12 @@ QList<float> Distance::compare(const TemplateList &targets, const Template &quer
     return scores;
 }
 
+void Distance::compare(const TemplateList &targets, const Template &query, float *scores) const
+{
+    const QList<float> row = compare(targets, query);
+    std::copy(row.begin(), row.end(), scores);
+}
+
 float Distance::compare(const Template &a, const Template &b) const
 {
     float similarity = 0;
@@ -1805,6 +2017,34 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
     return -std::numeric_limits<float>::max();
 }
 
+/* Distance - protected methods */
+void Distance::compareRows(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+{
+    // Empty targets are scored like compareBlock() does and never reach the batched comparison
+    TemplateList targets;
+    QList<int> indices;
+    for (int j=0; j<target.size(); j++)
+        if (!target[j].isEmpty()) {
+            targets.append(target[j]);
+            indices.append(j);
+        }
+
+    QVector<float> scores(targets.size());
+    for (int i=0; i<query.size(); i++) {
+        if (!query[i].isEmpty())
+            compare(targets, query[i], scores.data());
+
+        for (int j=0, k=0; j<target.size(); j++) {
+            if (query[i].isEmpty() || (k == indices.size()) || (indices[k] != j)) {
+                output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+            } else {
+                output->setRelative(scores[k], i+queryOffset, j+targetOffset);
+                k++;
+            }
+        }
+    }
+}
+
 /* Distance - private methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
@@ -19,6 +19,7 @@
 
 #ifdef __cplusplus
 
+#include <QAtomicInt>
 #include <QDataStream>
 #include <QDebug>
 #include <QDir>
@@ -30,6 +31,7 @@
 #include <QMap>
 #include <QPoint>
 #include <QPointF>
+#include <QReadWriteLock>
 #include <QRectF>
 #include <QScopedPointer>
 #include <QSharedPointer>
@@ -57,17 +59,17 @@ struct BR_EXPORT File
 {
     QString name;
 
-    File() { fte = false; }
+    File() : fte(false), m_hasPoints(false), m_hasRects(false) {}
     File(const QString &file) { init(file); }
     File(const QString &file, const QVariant &label) { init(file); set("Label", label); }
     File(const char *file) { init(file); }
-    File(const QVariantMap &metadata) : fte(false), m_metadata(metadata) {}
+    File(const QVariantMap &metadata) : fte(false), m_hasPoints(false), m_hasRects(false) { append(metadata); }
     inline operator QString() const { return name; }
     QString flat() const;
     QString hash() const;
 
-    inline QStringList localKeys() const { return m_metadata.keys(); }
-    inline QVariantMap localMetadata() const { return m_metadata; }
+    QStringList localKeys() const;
+    QVariantMap localMetadata() const;
 
     void append(const QVariantMap &localMetadata);
     void append(const File &other);
@@ -82,14 +84,16 @@ struct BR_EXPORT File
     inline QVariant getParameter(int index) const { return get<QVariant>("_Arg" + QString::number(index)); }
 
     inline bool operator==(const char* other) const { return name == other; }
-    inline bool operator==(const File &other) const { return (name == other.name) && (m_metadata == other.m_metadata); }
+    inline bool operator==(const File &other) const { return (name == other.name) && (m_metadata == other.m_metadata) &&
+                                                             (m_hasPoints == other.m_hasPoints) && (m_points == other.m_points) &&
+                                                             (m_hasRects == other.m_hasRects) && (m_rects == other.m_rects); }
     inline bool operator!=(const File &other) const { return !(*this == other); }
     inline bool operator<(const File &other) const { return name < other.name; }
     inline bool operator<=(const File &other) const { return name <= other.name; }
     inline bool operator>(const File &other) const { return name > other.name; }
     inline bool operator>=(const File &other) const { return name >= other.name; }
 
-    inline bool isNull() const { return name.isEmpty() && m_metadata.isEmpty(); }
+    inline bool isNull() const { return name.isEmpty() && m_metadata.isEmpty() && !m_hasPoints && !m_hasRects; }
     inline bool isTerminal() const { return name == "terminal"; }
     inline bool exists() const { return QFileInfo(name).exists(); } 
     inline QString fileName() const { return QFileInfo(name).fileName(); }
@@ -103,7 +107,7 @@ struct BR_EXPORT File
     bool contains(const QStringList &keys) const;
     QVariant value(const QString &key) const;
     static QVariant parse(const QString &value);
-    inline void set(const QString &key, const QVariant &value) { m_metadata.insert(key, value); }
+    void set(const QString &key, const QVariant &value);
     void set(const QString &key, const QString &value);
 
 
@@ -117,7 +121,7 @@ struct BR_EXPORT File
         set(key, variantList);
     }
 
-    inline void remove(const QString &key) { m_metadata.remove(key); }
+    void remove(const QString &key);
 
 
     template <typename T>
@@ -148,7 +152,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) qFatal("Missing key: %s in: %s", qPrintable(key), qPrintable(flat()));
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, value(key).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else qFatal("Failed to convert value for key %s in: %s", qPrintable(key), qPrintable(flat()));
         }
@@ -161,7 +165,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) return defaultValue;
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, value(key).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else return defaultValue;
         }
@@ -199,7 +203,7 @@ struct BR_EXPORT File
     QList<QPointF> points() const;
     void appendPoint(const QPointF &point);
     void appendPoints(const QList<QPointF> &points);
-    inline void clearPoints() { m_metadata["Points"] = QList<QVariant>(); }
+    inline void clearPoints() { m_metadata.remove("Points"); m_points.clear(); m_hasPoints = true; }
     inline void setPoints(const QList<QPointF> &points) { clearPoints(); appendPoints(points); }
 
     QList<QRectF> namedRects() const;
@@ -208,7 +212,7 @@ struct BR_EXPORT File
     void appendRect(const cv::Rect &rect);
     void appendRects(const QList<QRectF> &rects);
     void appendRects(const QList<cv::Rect> &rects);
-    inline void clearRects() { m_metadata["Rects"] = QList<QVariant>(); }
+    inline void clearRects() { m_metadata.remove("Rects"); m_rects.clear(); m_hasRects = true; }
     inline void setRects(const QList<QRectF> &rects) { clearRects(); appendRects(rects); }
     inline void setRects(const QList<cv::Rect> &rects) { clearRects(); appendRects(rects); }
 
@@ -216,7 +220,12 @@ struct BR_EXPORT File
 
     bool fte;
 private:
-    QVariantMap m_metadata;
+    QVariantMap m_metadata; // Everything except natively stored points and rects
+
+    // "Points" and "Rects" are kept as typed lists so appending doesn't copy a QVariantList
+    QList<QPointF> m_points;
+    QList<QRectF> m_rects;
+    bool m_hasPoints, m_hasRects;
     BR_EXPORT friend QDataStream &operator<<(QDataStream &stream, const File &file);
     BR_EXPORT friend QDataStream &operator>>(QDataStream &stream, File &file);
 
@@ -470,6 +479,10 @@ class BR_EXPORT Context : public Object
     Q_OBJECT
     QFile logFile;
 
+    // Meta-object property index per name, -1 for names that aren't static properties
+    mutable QReadWriteLock propertyIndexLock;
+    mutable QHash<QString,int> propertyIndices;
+
 public:
 
     Q_PROPERTY(QString sdkPath READ get_sdkPath WRITE set_sdkPath RESET reset_sdkPath)
@@ -530,10 +543,20 @@ public:
     Q_PROPERTY(QList<QString> modelSearch READ get_modelSearch WRITE set_modelSearch RESET reset_modelSearch)
     BR_PROPERTY(QList<QString>, modelSearch, QList<QString>() )
 
+    Q_PROPERTY(bool chunkPipes READ get_chunkPipes WRITE set_chunkPipes RESET reset_chunkPipes)
+    BR_PROPERTY(bool, chunkPipes, false)
+
+    Q_PROPERTY(bool streamTraining READ get_streamTraining WRITE set_streamTraining RESET reset_streamTraining)
+    BR_PROPERTY(bool, streamTraining, false)
+
+    Q_PROPERTY(int modelCompression READ get_modelCompression WRITE set_modelCompression RESET reset_modelCompression)
+    BR_PROPERTY(int, modelCompression, -1)
+
     QHash<QString,QString> abbreviations;
     QTime startTime;
 
-    bool contains(const QString &name);
+    bool contains(const QString &name) const;
+    QVariant value(const QString &name) const;
     void printStatus();
     float progress() const;
     void setProperty(const QString &key, const QString &value);
@@ -784,6 +807,8 @@ public:
 
     virtual void finalize(TemplateList &output) { output = TemplateList(); }
     virtual bool timeVarying() const { return false; }
+    virtual int trainingSamples() const { return 0; }
+    virtual int tileRadius() const { return -1; }
 
     inline Template operator()(const Template &src) const
     {
@@ -817,9 +842,15 @@ public:
     virtual Transform * simplify(bool &newTransform) { newTransform = false; return this; }
     virtual QByteArray likely(const QByteArray &indentation) const { (void) indentation; return "src"; }
 
+    int projectChunkSize(int size) const;
+    void recordProjectCost(qint64 nsecs, int templates) const;
+
 protected:
     Transform(bool independent = true, bool trainable = true);
     inline Transform *make(const QString &description) { return make(description, this); }
+
+private:
+    mutable QAtomicInt projectCost; // Running estimate of nanoseconds per template, zero until measured
 };
 
 inline Template &operator>>(Template &srcdst, const Transform &f)
@@ -860,12 +891,14 @@ public:
     virtual void train(const TemplateList &src) = 0;
     virtual void compare(const TemplateList &target, const TemplateList &query, Output *output) const;
     virtual QList<float> compare(const TemplateList &targets, const Template &query) const;
+    virtual void compare(const TemplateList &targets, const Template &query, float *scores) const;
     virtual float compare(const Template &a, const Template &b) const;
     virtual float compare(const cv::Mat &a, const cv::Mat &b) const;
     virtual float compare(const uchar *a, const uchar *b, size_t size) const;
 
 protected:
     inline Distance *make(const QString &description) { return make(description, this); }
+    void compareRows(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
 
 private:
     virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
@@ -894,6 +927,7 @@ public:
     virtual int numChannels() const { return 1; }
     virtual int numFeatures() const = 0;
     virtual int maxCatCount() const = 0;
+    virtual QVector<float> featureValues() const { return QVector<float>(); } // Sorted set of every value an ordered feature can take, empty if there are more than 65536
 };
 
 class BR_EXPORT Classifier : public Object
@@ -94,6 +94,9 @@ static void storeRecursive(QDataStream &stream, const Node *node, int maxCatCoun
  * \br_property int maxDepth The maximum depth for each trained tree
  * \br_property int maxWeakCount The maximum number of trees in the forest
  * \br_property Type type. The type of boosting to perform. Options are [Discrete, Real, Logit, Gentle]. Gentle is the default.
+ * \br_property int precalcValBufSize Memory in MB for precalculated feature values during training.
+ * \br_property int precalcIdxBufSize Memory in MB for training samples presorted by feature value during training.
+ * \br_property int precalcSpillSize Local disk in MB for precalculated features that don't fit in memory, in a memory-mapped temporary file.
  */
 class BoostedForestClassifier : public Classifier
 {
@@ -108,6 +111,9 @@ class BoostedForestClassifier : public Classifier
     Q_PROPERTY(int maxWeakCount READ get_maxWeakCount WRITE set_maxWeakCount RESET reset_maxWeakCount STORED false)
     Q_PROPERTY(Type type READ get_type WRITE set_type RESET reset_type STORED false)
     Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(int precalcValBufSize READ get_precalcValBufSize WRITE set_precalcValBufSize RESET reset_precalcValBufSize STORED false)
+    Q_PROPERTY(int precalcIdxBufSize READ get_precalcIdxBufSize WRITE set_precalcIdxBufSize RESET reset_precalcIdxBufSize STORED false)
+    Q_PROPERTY(int precalcSpillSize READ get_precalcSpillSize WRITE set_precalcSpillSize RESET reset_precalcSpillSize STORED false)
 
 public:
     QList<Node*> classifiers;
@@ -125,6 +131,9 @@ private:
     BR_PROPERTY(int, maxWeakCount, 100)
     BR_PROPERTY(Type, type, Gentle)
     BR_PROPERTY(float, threshold, 0)
+    BR_PROPERTY(int, precalcValBufSize, 1024)
+    BR_PROPERTY(int, precalcIdxBufSize, 1024)
+    BR_PROPERTY(int, precalcSpillSize, 0)
 
     void train(const TemplateList &data)
     {
@@ -139,7 +148,7 @@ private:
             featureEvaluator.setImage(data[i], data[i].file.get<float>("Label"), i);
 
         CascadeBoost boost;
-        boost.train(&featureEvaluator, data.size(), 1024, 1024, representation->numChannels(), params);
+        boost.train(&featureEvaluator, data.size(), precalcValBufSize, precalcIdxBufSize, precalcSpillSize, representation->numChannels(), params);
 
         threshold = boost.getThreshold();
 
@@ -2,7 +2,6 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/common.h>
 #include "openbr/core/opencvutils.h"
 
 #include <QtConcurrent>
@@ -12,78 +11,27 @@ using namespace cv;
 namespace br
 {
 
-struct Miner
+// A background image mined for hard negatives, and what was found in it
+struct NegativeJob
 {
-    Template src;
-    Template scaledSrc;
-    Size windowSize;
-    Point offset, point;
-    float scale, scaleFactor, stepFactor;
-
-    Miner(const Template &t, const Size &windowSize, const Point &offset) :
-        src(t),
-        windowSize(windowSize),
-        offset(offset),
-        point(offset)
-    {
-        scale       = 1.0F;
-        scaleFactor = 1.4142135623730950488016887242097F;
-        stepFactor  = 0.5F;
-
-        scale = max(((float)windowSize.width + point.x) / ((float)src.m().cols),
-                    ((float)windowSize.height + point.y) / ((float)src.m().rows));
-        Size size((int)(scale*src.m().cols + 0.5F), (int)(scale*src.m().rows + 0.5F));
-        scaledSrc = resize(src, size);
-    }
-
-    Template resize(const Template &src, const Size &size)
-    {
-        Template dst(src.file);
-        for (int i=0; i<src.size(); i++) {
-            Mat buffer;
-            cv::resize(src[i], buffer, size);
-            dst.append(buffer);
-        }
-        return dst;
-    }
-
-    Template mine(bool *newImg)
-    {
-        Template dst(src.file);
-        // Copy region of winSize region of img into m
-        for (int i=0; i<scaledSrc.size(); i++) {
-            Mat window(windowSize.height, windowSize.width, CV_8U,
-                       (void*)(scaledSrc[i].data + point.y * scaledSrc[i].step + point.x * scaledSrc[i].elemSize()),
-                       scaledSrc[i].step);
-            Mat sample;
-            window.copyTo(sample);
-            dst.append(sample);
-        }
-
-        if ((int)(point.x + (1.0F + stepFactor) * windowSize.width) < scaledSrc.m().cols)
-            point.x += (int)(stepFactor * windowSize.width);
-        else {
-            point.x = offset.x;
-            if ((int)(point.y + (1.0F + stepFactor) * windowSize.height) < scaledSrc.m().rows)
-                point.y += (int)(stepFactor * windowSize.height);
-            else {
-                point.y = offset.y;
-                scale *= scaleFactor;
-                if (scale <= 1.0F) {
-                    Size size((int)(scale*src.m().cols), (int)(scale*src.m().rows));
-                    scaledSrc = resize(src, size);
-                } else {
-                    *newImg = true;
-                    return dst;
-                }
-            }
-        }
-
-        *newImg = false;
-        return dst;
-    }
+    Template image;
+    Point offset;
+    qint64 cursor;
+    TemplateList samples;
+    QList<uint64> passedAt; // Windows checked up to and including each sample
+    uint64 passed;
 };
 
+static QList<int> shuffledIndices(int n, RNG &rng)
+{
+    QList<int> indices;
+    for (int i = 0; i < n; i++)
+        indices.append(i);
+    for (int i = n - 1; i > 0; i--)
+        indices.swap(i, rng.uniform(0, i + 1));
+    return indices;
+}
+
 /*!
  * \brief A meta Classifier that creates a cascade of another Classifier. The cascade is a series of stages, each with its own instance of a given classifier. A sample can only reach the next stage if it is classified as positive by the previous stage.
  * \author Jordan Cheney \cite jcheney
@@ -94,6 +42,7 @@ struct Miner
  * \br_property float maxFAR A termination parameter. Calculated as (number of passed negatives) / (total number of checked negatives) for a given stage during training. If that number is below the given maxFAR cascade training is terminated early. This can help prevent overfitting.
  * \br_property bool requireAllStages If true, the cascade will train until it has the number of stages specified by numStages even if the FAR at a given is lower than maxFAR.
  * \br_property int maxStage Parameter to limit the stages used at test time. If -1 (default), all numStages stages will be used.
+ * \br_property int seed Seed for the order in which positive and negative images are sampled. Mined negatives depend only on the seed, not on thread scheduling or parallelism.
  * \br_paper Paul Viola, Michael Jones
  *           Rapid Object Detection using a Boosted Cascade of Simple Features
  *           CVPR, 2001
@@ -111,6 +60,7 @@ class CascadeClassifier : public Classifier
     Q_PROPERTY(bool requireAllStages READ get_requireAllStages WRITE set_requireAllStages RESET reset_requireAllStages STORED false)
     Q_PROPERTY(int maxStage READ get_maxStage WRITE set_maxStage RESET reset_maxStage STORED false)
     Q_PROPERTY(QList<br::Classifier*> stages READ get_stages WRITE set_stages RESET reset_stages STORED false)
+    Q_PROPERTY(int seed READ get_seed WRITE set_seed RESET reset_seed STORED false)
 
     BR_PROPERTY(QString, stageDescription, "")
     BR_PROPERTY(int, numStages, 20)
@@ -120,18 +70,19 @@ class CascadeClassifier : public Classifier
     BR_PROPERTY(bool, requireAllStages, false)
     BR_PROPERTY(int, maxStage, -1)
     BR_PROPERTY(QList<br::Classifier*>, stages, QList<br::Classifier*>())
+    BR_PROPERTY(int, seed, 0)
 
     TemplateList posImages, negImages;
     TemplateList posSamples, negSamples;
 
     QList<int> negIndices, posIndices;
-    int negIndex, posIndex, samplingRound;
-
-    QMutex samplingMutex, miningMutex;
+    int posIndex;
+    qint64 negCursor;
 
     void init()
     {
-        negIndex = posIndex = samplingRound = 0;
+        posIndex = 0;
+        negCursor = 0;
     }
 
     bool getPositive(Template &img)
@@ -142,64 +93,141 @@ class CascadeClassifier : public Classifier
         return true;
     }
 
-    Template getNegative(Point &offset)
+    // Negatives are drawn from an endless stream of passes over the shuffled images,
+    // each pass starting the windows at a different offset.
+    bool getNegative(NegativeJob *job)
     {
-        Template negative;
-
         const Size size = windowSize();
-        // Grab negative from list
-        int count = negImages.size();
+        const int count = negImages.size();
         for (int i = 0; i < count; i++) {
-            negative = negImages[negIndices[negIndex++]];
+            const qint64 cursor = negCursor++;
+            const Template &negative = negImages[negIndices[cursor % count]];
+            const int samplingRound = (cursor / count) % (size.width * size.height);
 
-            samplingRound += negIndex / count;
-            samplingRound = samplingRound % (size.width * size.height);
-            negIndex %= count;
-
-            offset.x = qMin( (int)samplingRound % size.width, negative.m().cols - size.width);
-            offset.y = qMin( (int)samplingRound / size.width, negative.m().rows - size.height);
+            const Point offset(qMin(samplingRound % size.width, negative.m().cols - size.width),
+                               qMin(samplingRound / size.width, negative.m().rows - size.height));
             if (!negative.m().empty() && negative.m().type() == CV_8U
-                    && offset.x >= 0 && offset.y >= 0)
-                break;
+                    && offset.x >= 0 && offset.y >= 0) {
+                job->image = negative;
+                job->offset = offset;
+                job->cursor = cursor;
+                job->passed = 0;
+                return true;
+            }
         }
+        return false;
+    }
 
-        return negative;
+    void mineQueue(QList<NegativeJob*> jobs, int limit) const
+    {
+        foreach (NegativeJob *job, jobs)
+            mine(job, limit);
     }
 
-    uint64 mine()
+    // Searches a pyramid of windows over the image, keeping up to limit windows accepted by the trained stages
+    void mine(NegativeJob *job, int limit) const
     {
-        uint64 passedNegatives = 0;
+        static const int batchSize = 256;
+        const Mat &image = job->image.m();
+        const Size size = windowSize();
+        const int xStep = qMax((int)(0.5F * size.width), 1);
+        const int yStep = qMax((int)(0.5F * size.height), 1);
+
+        // The last stage is the one being trained
+        const int stopStage = maxStage == -1 ? numStages : maxStage;
+        const int trainedStages = qMin(stages.size() - 1, stopStage);
+
+        float scale = qMax(((float)size.width + job->offset.x) / ((float)image.cols),
+                          ((float)size.height + job->offset.y) / ((float)image.rows));
+        Size levelSize((int)(scale*image.cols + 0.5F), (int)(scale*image.rows + 0.5F));
+
         forever {
-            Template negative;
-            Point offset;
-            QMutexLocker samplingLocker(&samplingMutex);
-            negative = getNegative(offset);
-            samplingLocker.unlock();
-
-            Miner miner(negative, windowSize(), offset);
-            forever {
-                bool newImg;
-                Template sample = miner.mine(&newImg);
-                if (!newImg) {
-                    if (negSamples.size() >= numNegs)
-                        return passedNegatives;
+            Template level(job->image.file);
+            foreach (const Mat &m, job->image) {
+                Mat buffer;
+                cv::resize(m, buffer, levelSize);
+                level.append(buffer);
+            }
 
-                    float confidence;
-                    if (classify(sample, true, &confidence) != 0) {
-                        QMutexLocker miningLocker(&miningMutex);
-                        if (negSamples.size() >= numNegs)
-                            return passedNegatives;
-                        negSamples.append(sample);
-                        printf("Negative samples: %d\r", negSamples.size());
-                    }
-
-                    passedNegatives++;
-                } else
+            // Preprocessed once for every batch of windows on this level
+            const Template rep = trainedStages > 0 ? preprocess(level) : Template();
+
+            QList<Point> batch;
+            for (int y = job->offset.y; y + size.height <= levelSize.height; y += yStep) {
+                for (int x = job->offset.x; x + size.width <= levelSize.width; x += xStep) {
+                    batch.append(Point(x, y));
+                    if ((int)(x + 1.5F * size.width) >= levelSize.width)
+                        break;
+                }
+
+                const bool lastRow = (int)(y + 1.5F * size.height) >= levelSize.height;
+                if ((batch.size() >= batchSize) || lastRow) {
+                    if (classifyBatch(level, rep, trainedStages, batch, job, limit))
+                        return;
+                    batch.clear();
+                }
+                if (lastRow)
                     break;
             }
+
+            scale *= 1.4142135623730950488016887242097F;
+            if (scale > 1.0F)
+                return;
+            levelSize = Size((int)(scale*image.cols), (int)(scale*image.rows));
         }
     }
 
+    // Evaluates a batch of windows on the level, and its preprocessed representation rep, one trained stage at a time
+    // so each stage stays in cache, returns true once the job holds limit samples.
+    bool classifyBatch(const Template &level, const Template &rep, int trainedStages, const QList<Point> &batch, NegativeJob *job, int limit) const
+    {
+        if (batch.isEmpty())
+            return false;
+
+        QList<int> survivors;
+        for (int i = 0; i < batch.size(); i++)
+            survivors.append(i);
+
+        if (trainedStages > 0) {
+            int dx, dy;
+            const Size size = windowSize(&dx, &dy);
+
+            QList<Template> windows;
+            foreach (const Point &point, batch) {
+                Template window(level.file);
+                foreach (const Mat &m, rep)
+                    window.append(m(Rect(point, Size(size.width + dx, size.height + dy))).clone());
+                windows.append(window);
+            }
+
+            for (int stage = 0; (stage < trainedStages) && !survivors.isEmpty(); stage++) {
+                QList<int> passed;
+                foreach (int i, survivors) {
+                    float confidence;
+                    if (stages[stage]->classify(windows[i], false, &confidence) != 0.0f)
+                        passed.append(i);
+                }
+                survivors = passed;
+            }
+        }
+
+        const Size size = windowSize();
+        foreach (int i, survivors) {
+            Template sample(level.file);
+            foreach (const Mat &m, level)
+                sample.append(m(Rect(batch[i], size)).clone());
+            job->samples.append(sample);
+            job->passedAt.append(job->passed + i + 1);
+            if (job->samples.size() >= limit) {
+                job->passed = job->passedAt.last();
+                return true;
+            }
+        }
+
+        job->passed += batch.size();
+        return false;
+    }
+
     void train(const TemplateList &data)
     {
         foreach (const Template &t, data)
@@ -209,8 +237,9 @@ class CascadeClassifier : public Classifier
                  << "\nTotal positive images:" << posImages.size()
                  << "\nTotal negative images:" << negImages.size();
 
-        posIndices = Common::RandSample(posImages.size(), posImages.size(), true);
-        negIndices = Common::RandSample(negImages.size(), negImages.size(), true);
+        RNG rng(seed);
+        posIndices = shuffledIndices(posImages.size(), rng);
+        negIndices = shuffledIndices(negImages.size(), rng);
 
         stages.reserve(numStages);
         for (int i = 0; i < numStages; i++) {
@@ -303,15 +332,48 @@ private:
 
         qDebug() << "POS count : consumed  " << posSamples.size() << ":" << posIndex;
 
-        QFutureSynchronizer<uint64> futures;
-        for (int i=0; i<QThread::idealThreadCount(); i++)
-            futures.addFuture(QtConcurrent::run(this, &CascadeClassifier::mine));
-        futures.waitForFinished();
+        // Mine in rounds of consecutive images, split into one queue per thread.
+        // Results are merged in image order, so the samples don't depend on scheduling.
+        const int threads = std::max(1, abs(Globals->parallelism));
+        const int imagesPerThread = 4;
 
         uint64 passedNegs = 0;
-        QList<QFuture<uint64> > results = futures.futures();
-        for (int i=0; i<results.size(); i++)
-            passedNegs += results[i].result();
+        while (negSamples.size() < numNegs) {
+            const int limit = numNegs - negSamples.size();
+
+            QList<NegativeJob> jobs;
+            for (int i = 0; i < threads * imagesPerThread; i++) {
+                NegativeJob job;
+                if (!getNegative(&job))
+                    qFatal("Cannot get another negative sample!");
+                jobs.append(job);
+            }
+
+            QFutureSynchronizer<void> futures;
+            for (int i = 0; i < threads; i++) {
+                QList<NegativeJob*> queue;
+                for (int j = i; j < jobs.size(); j += threads)
+                    queue.append(&jobs[j]);
+                if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &CascadeClassifier::mineQueue, queue, limit));
+                else                      mineQueue(queue, limit);
+            }
+            futures.waitForFinished();
+
+            foreach (const NegativeJob &job, jobs) {
+                const int needed = numNegs - negSamples.size();
+                if (job.samples.size() < needed) {
+                    negSamples.append(job.samples);
+                    passedNegs += job.passed;
+                } else {
+                    negSamples.append(job.samples.mid(0, needed));
+                    passedNegs += job.passedAt[needed - 1];
+                    // The next stage resumes with the image after this one
+                    negCursor = job.cursor + 1;
+                    break;
+                }
+            }
+            printf("Negative samples: %d\r", negSamples.size());
+        }
 
         double acceptanceRatio = negSamples.size() / (double)passedNegs;
         qDebug() << "NEG count : acceptanceRatio  " << negSamples.size() << ":" << acceptanceRatio;
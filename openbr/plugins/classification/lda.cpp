@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <Eigen/Dense>
+#include <QtConcurrent>
 #include <openbr/plugins/openbr_internal.h>
 
 #include <openbr/core/common.h>
@@ -42,6 +43,206 @@ class EigenInitializer : public Initializer
 
 BR_REGISTER(Initializer, EigenInitializer)
 
+struct BlockProjection
+{
+    const Eigen::MatrixXf *projection;
+    const Eigen::VectorXf *mean;
+    const TemplateList *src;
+    TemplateList *dst;
+};
+
+// Projects src[begin, end) as one matrix product, results are rows of a single output matrix
+static void projectBlock(const BlockProjection *block, int begin, int end)
+{
+    const Eigen::MatrixXf &projection = *block->projection;
+    const Eigen::VectorXf &mean = *block->mean;
+    const int n = end - begin;
+
+    Eigen::MatrixXf data(mean.rows(), n);
+    for (int i=0; i<n; i++)
+        data.col(i) = Eigen::Map<const Eigen::VectorXf>((*block->src)[begin+i].m().ptr<float>(), mean.rows()) - mean;
+
+    cv::Mat out(n, projection.cols(), CV_32FC1);
+    Eigen::Map<Eigen::MatrixXf> outMap(out.ptr<float>(), projection.cols(), n);
+    outMap.noalias() = projection.transpose() * data;
+
+    for (int i=0; i<n; i++)
+        (*block->dst)[begin+i] = Template((*block->src)[begin+i].file, out.row(i));
+}
+
+// Returns false if any template can't be stacked, in which case the caller should project them individually
+static bool projectBlocks(const Eigen::MatrixXf &projection, const Eigen::VectorXf &mean, const TemplateList &src, TemplateList &dst)
+{
+    foreach (const Template &t, src)
+        if ((t.size() != 1) || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (int(t.m().total()) != mean.rows()))
+            return false;
+
+    dst.reserve(dst.size() + src.size());
+    TemplateList results;
+    for (int i=0; i<src.size(); i++)
+        results.append(Template());
+
+    BlockProjection block;
+    block.projection = &projection;
+    block.mean = &mean;
+    block.src = &src;
+    block.dst = &results;
+
+    // Large enough to keep the product compute bound, small enough to spread across threads
+    static const int blockSize = 256;
+    if ((abs(Globals->parallelism) <= 1) || (src.size() <= blockSize) || SerialProjectScope::active()) {
+        for (int i=0; i<src.size(); i+=blockSize)
+            projectBlock(&block, i, std::min(i+blockSize, src.size()));
+    } else {
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<src.size(); i+=blockSize)
+            futures.addFuture(QtConcurrent::run(projectBlock, &block, i, std::min(i+blockSize, src.size())));
+        futures.waitForFinished();
+    }
+
+    dst.append(results);
+    return true;
+}
+
+// PCA training data, read in place rather than copied into one matrix
+struct ScatterColumns
+{
+    int dims;
+    QList<const float*> columns;
+    QList<int> groups;          // If non-empty, groupMeans.col(groups[i]) is removed from columns[i]
+    Eigen::MatrixXd groupMeans;
+
+    explicit ScatterColumns(int dims) : dims(dims) {}
+
+    explicit ScatterColumns(const Eigen::MatrixXf &data) : dims(data.rows())
+    {
+        for (int i=0; i<data.cols(); i++)
+            columns.append(data.data() + i*data.rows());
+    }
+
+    explicit ScatterColumns(const TemplateList &templates) : dims(templates.first().m().rows * templates.first().m().cols)
+    {
+        foreach (const Template &t, templates) {
+            if ((t.m().type() != CV_32FC1) || !t.m().isContinuous() || (int(t.m().total()) != dims))
+                qFatal("Requires continuous single channel 32-bit floating point matrices of equal size.");
+            columns.append(t.m().ptr<float>());
+        }
+    }
+
+    int size() const { return columns.size(); }
+
+    Eigen::MatrixXd toMatrix() const
+    {
+        Eigen::MatrixXd data(dims, size());
+        for (int i=0; i<size(); i++) {
+            data.col(i) = Eigen::Map<const Eigen::VectorXf>(columns[i], dims).cast<double>();
+            if (!groups.isEmpty()) data.col(i) -= groupMeans.col(groups[i]);
+        }
+        return data;
+    }
+};
+
+struct ScatterPass
+{
+    enum Mode { Sum, Scatter, Subspace };
+
+    Mode mode;
+    const ScatterColumns *data;
+    const Eigen::MatrixXf *offsets; // Column 0, or column groups[i], is subtracted from columns[i]
+    const Eigen::MatrixXf *basis;
+    int begin, end;
+
+    Eigen::VectorXd sum;
+    double squaredNorm;
+    Eigen::MatrixXf product, gram;
+};
+
+// Streams columns [begin, end) through the accumulator selected by mode:
+//   Sum      - sum and total squared norm of the columns
+//   Scatter  - lower triangle of the d x d scatter matrix
+//   Subspace - scatter * basis and basis^T * scatter * basis
+static void scatterPass(ScatterPass *pass)
+{
+    const ScatterColumns &data = *pass->data;
+    const Eigen::MatrixXf &offsets = *pass->offsets;
+    const int d = data.dims;
+
+    if (pass->mode == ScatterPass::Sum) {
+        pass->sum = Eigen::VectorXd::Zero(d);
+        pass->squaredNorm = 0;
+    } else if (pass->mode == ScatterPass::Scatter) {
+        pass->product = Eigen::MatrixXf::Zero(d, d);
+    } else {
+        pass->product = Eigen::MatrixXf::Zero(d, pass->basis->cols());
+        pass->gram = Eigen::MatrixXf::Zero(pass->basis->cols(), pass->basis->cols());
+    }
+
+    static const int blockSize = 256;
+    Eigen::MatrixXf block(d, std::min(blockSize, pass->end - pass->begin));
+    for (int i=pass->begin; i<pass->end; i+=blockSize) {
+        const int n = std::min(blockSize, pass->end - i);
+        for (int j=0; j<n; j++)
+            block.col(j) = Eigen::Map<const Eigen::VectorXf>(data.columns[i+j], d) - offsets.col(data.groups.isEmpty() ? 0 : data.groups[i+j]);
+
+        if (pass->mode == ScatterPass::Sum) {
+            for (int j=0; j<n; j++) {
+                pass->sum += block.col(j).cast<double>();
+                pass->squaredNorm += block.col(j).cast<double>().squaredNorm();
+            }
+        } else if (pass->mode == ScatterPass::Scatter) {
+            pass->product.selfadjointView<Eigen::Lower>().rankUpdate(block.leftCols(n));
+        } else {
+            const Eigen::MatrixXf projected = block.leftCols(n).transpose() * *pass->basis;
+            pass->product.noalias() += block.leftCols(n) * projected;
+            pass->gram.noalias() += projected.transpose() * projected;
+        }
+    }
+}
+
+// Runs scatterPass over one contiguous column range per thread and sums the partial results into the first pass
+static ScatterPass accumulateScatter(ScatterPass::Mode mode, const ScatterColumns &data, const Eigen::MatrixXf &offsets, const Eigen::MatrixXf *basis = NULL)
+{
+    const int threads = std::max(1, std::min(SerialProjectScope::active() ? 1 : abs(Globals->parallelism), data.size() / 256));
+
+    QVector<ScatterPass> passes(threads);
+    for (int t=0; t<threads; t++) {
+        passes[t].mode = mode;
+        passes[t].data = &data;
+        passes[t].offsets = &offsets;
+        passes[t].basis = basis;
+        passes[t].begin = int(qint64(data.size()) * t / threads);
+        passes[t].end = int(qint64(data.size()) * (t+1) / threads);
+    }
+
+    if (threads == 1) {
+        scatterPass(&passes[0]);
+    } else {
+        QFutureSynchronizer<void> futures;
+        for (int t=0; t<threads; t++)
+            futures.addFuture(QtConcurrent::run(scatterPass, &passes[t]));
+        futures.waitForFinished();
+    }
+
+    ScatterPass &result = passes[0];
+    for (int t=1; t<threads; t++) {
+        if (mode == ScatterPass::Sum) {
+            result.sum += passes[t].sum;
+            result.squaredNorm += passes[t].squaredNorm;
+        } else {
+            result.product += passes[t].product;
+            if (mode == ScatterPass::Subspace)
+                result.gram += passes[t].gram;
+        }
+    }
+    return result;
+}
+
+static Eigen::MatrixXf orthonormalize(const Eigen::MatrixXf &m)
+{
+    const Eigen::HouseholderQR<Eigen::MatrixXf> qr(m);
+    return qr.householderQ() * Eigen::MatrixXf::Identity(m.rows(), m.cols());
+}
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
@@ -51,6 +252,8 @@ BR_REGISTER(Initializer, EigenInitializer)
  * \br_property float keep Options are: [keep < 0 - All eigenvalues are retained, keep == 0 - No PCA is performed and the eigenvectors form an identity matrix, 0 < keep < 1 - Keep is the fraction of the variance to retain, keep >= 1 - keep is the number of leading eigenvectors to retain] Default is 0.95.
  * \br_property int drop The number of leading eigen-dimensions to drop.
  * \br_property bool whiten Whether or not to perform PCA whitening (i.e., normalize variance of each dimension to unit norm)
+ * \br_property bool randomized Whether or not to estimate only the leading eigenvectors by randomized subspace iteration. The training data is streamed in parallel blocks instead of being copied, and a fractional keep grows the subspace until the requested variance is captured. Recommended when keep is much smaller than the dimensionality and sample count.
+ * \br_property int iterations Number of power iterations performed when randomized, more iterations improve accuracy when the spectrum decays slowly.
  */
 class PCATransform : public Transform
 {
@@ -61,10 +264,14 @@ protected:
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
     Q_PROPERTY(int drop READ get_drop WRITE set_drop RESET reset_drop STORED false)
     Q_PROPERTY(bool whiten READ get_whiten WRITE set_whiten RESET reset_whiten STORED false)
+    Q_PROPERTY(bool randomized READ get_randomized WRITE set_randomized RESET reset_randomized STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
 
     BR_PROPERTY(float, keep, 0.95)
     BR_PROPERTY(int, drop, 0)
     BR_PROPERTY(bool, whiten, false)
+    BR_PROPERTY(bool, randomized, false)
+    BR_PROPERTY(int, iterations, 2)
 
     Eigen::VectorXf mean, eVals;
     Eigen::MatrixXf eVecs;
@@ -72,7 +279,7 @@ protected:
     int originalRows;
 
 public:
-    PCATransform() : keep(0.95), drop(0), whiten(false) {}
+    PCATransform() : keep(0.95), drop(0), whiten(false), randomized(false), iterations(2) {}
 
 private:
     double residualReconstructionError(const Template &src) const
@@ -92,15 +299,7 @@ private:
             qFatal("Requires single channel 32-bit floating point matrices.");
 
         originalRows = trainingSet.first().m().rows;
-        int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
-        const int instances = trainingSet.size();
-
-        // Map into 64-bit Eigen matrix
-        Eigen::MatrixXd data(dimsIn, instances);
-        for (int i=0; i<instances; i++)
-            data.col(i) = Eigen::Map<const Eigen::MatrixXf>(trainingSet[i].m().ptr<float>(), dimsIn, 1).cast<double>();
-
-        trainCore(data);
+        trainCore(ScatterColumns(trainingSet));
     }
 
     void project(const Template &src, Template &dst) const
@@ -115,6 +314,12 @@ private:
         outMap = eVecs.transpose() * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectBlocks(eVecs, mean, src, dst))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << keep << drop << whiten << originalRows << mean << eVals << eVecs;
@@ -126,8 +331,20 @@ private:
     }
 
 protected:
+    void trainCore(const ScatterColumns &data)
+    {
+        if (randomized && (keep != 0)) trainRandomized(data);
+        else                           trainCore(data.toMatrix());
+    }
+
     void trainCore(Eigen::MatrixXd data)
     {
+        if (randomized && (keep != 0)) {
+            const Eigen::MatrixXf floatData = data.cast<float>();
+            trainRandomized(ScatterColumns(floatData));
+            return;
+        }
+
         int dimsIn = data.rows();
         int instances = data.cols();
         const bool dominantEigenEstimation = (dimsIn > instances);
@@ -156,11 +373,87 @@ protected:
             allEVals = Eigen::VectorXd::Ones(dimsIn);
         }
 
-        if (keep <= 0) {
-            keep = dimsIn - drop;
-        } else if (keep < 1) {
+        if (keep <= 0) keep = dimsIn - drop;
+        keepComponents(allEVals, allEVecs, allEVals.sum());
+
+        // Debug output
+        if (Globals->verbose) qDebug() << "PCA Training:\n\tDimsIn =" << dimsIn << "\n\tKeep =" << keep;
+    }
+
+    // Estimates the leading eigenvectors of the covariance without forming it, see:
+    // Halko, Martinsson & Tropp, "Finding structure with randomness", SIAM Review 2011.
+    void trainRandomized(const ScatterColumns &data)
+    {
+        const int dimsIn = data.dims;
+        const int instances = data.size();
+        const int rank = std::min(dimsIn, instances);
+
+        // Group means, then the overall mean, are removed from each block as it is read
+        Eigen::MatrixXf offsets = Eigen::MatrixXf::Zero(dimsIn, data.groups.isEmpty() ? 1 : data.groupMeans.cols());
+        if (!data.groups.isEmpty()) offsets = data.groupMeans.cast<float>();
+
+        const ScatterPass sum = accumulateScatter(ScatterPass::Sum, data, offsets);
+        const Eigen::VectorXd mean64 = sum.sum / instances;
+        mean = mean64.cast<float>();
+        offsets.colwise() += mean;
+        const double totalEnergy = (sum.squaredNorm - instances * mean64.squaredNorm()) / (instances-1.0);
+
+        // A fractional keep starts small and doubles until enough energy is captured
+        static const int oversampling = 10;
+        int components = (keep < 0) ? rank : (keep < 1 ? 64 : int(keep) + drop);
+
+        Eigen::VectorXd allEVals;
+        Eigen::MatrixXd allEVecs;
+        Eigen::MatrixXf basis;
+        cv::RNG rng(dimsIn);
+        while (true) {
+            const int samples = std::min(components + oversampling, rank);
+
+            if (dimsIn <= 4 * samples) {
+                // Most of the spectrum is needed, the d x d scatter matrix (lower triangle) is the cheaper route
+                const ScatterPass scatter = accumulateScatter(ScatterPass::Scatter, data, offsets);
+                Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(scatter.product.cast<double>() / (instances-1.0));
+                allEVals = eSolver.eigenvalues();
+                allEVecs = eSolver.eigenvectors();
+                break;
+            }
+
+            // Warm start from the previous, smaller, subspace
+            cv::Mat gaussian(samples, dimsIn, CV_32FC1);
+            rng.fill(gaussian, cv::RNG::NORMAL, 0, 1);
+            Eigen::MatrixXf start = Eigen::Map<const Eigen::MatrixXf>(gaussian.ptr<float>(), dimsIn, samples);
+            start.leftCols(basis.cols()) = basis;
+            basis = orthonormalize(start);
+
+            // Once the subspace spans every sample no power iterations are needed to be exact
+            const int passes = (samples == rank ? 0 : std::max(iterations, 0)) + 2;
+            ScatterPass subspace;
+            for (int i=0; i<passes; i++) {
+                if (i > 0) basis = orthonormalize(subspace.product);
+                subspace = accumulateScatter(ScatterPass::Subspace, data, offsets, &basis);
+            }
+
+            // Rayleigh-Ritz projection onto the converged subspace
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(subspace.gram.cast<double>() / (instances-1.0));
+            allEVals = eSolver.eigenvalues();
+            allEVecs = basis.cast<double>() * eSolver.eigenvectors();
+
+            if ((keep >= 1) || (keep < 0) || (samples == rank) || (allEVals.tail(components).sum() >= keep * totalEnergy))
+                break;
+            components *= 2;
+        }
+
+        if (keep < 0) keep = allEVals.rows() - drop;
+        keepComponents(allEVals, allEVecs, totalEnergy);
+
+        if (Globals->verbose) qDebug() << "Randomized PCA Training:\n\tDimsIn =" << dimsIn << "\n\tSubspace =" << allEVals.rows() << "\n\tKeep =" << keep;
+    }
+
+    // Retains eigenvectors according to keep and drop, eigenvalues are in increasing order
+    void keepComponents(const Eigen::MatrixXd &allEVals, const Eigen::MatrixXd &allEVecs, double totalEnergy)
+    {
+        if (keep < 1) {
             // Keep eigenvectors that retain a certain energy percentage.
-            const double totalEnergy = allEVals.sum();
             if (totalEnergy == 0) {
                 keep = 0;
             } else {
@@ -188,9 +481,6 @@ protected:
             eVecs.col(i) = allEVecs.col(index).cast<float>() / allEVecs.col(index).norm();
             if (whiten) eVecs.col(i) /= sqrt(eVals(i));
         }
-
-        // Debug output
-        if (Globals->verbose) qDebug() << "PCA Training:\n\tDimsIn =" << dimsIn << "\n\tKeep =" << keep;
     }
 
     void writeEigenVectors(const Eigen::MatrixXd &allEVals, const Eigen::MatrixXd &allEVecs) const
@@ -230,6 +520,7 @@ BR_REGISTER(Transform, PCATransform)
  * \br_property QString inputVariable Metadata key for subject labels. 
  * \br_property bool isBinary Whether or not to perform binary LDA. Default is multi-class LDA (i.e., distance metric learning).
  * \br_property bool normalize For binary LDA, whether or not to z-score normalize projection.
+ * \br_property bool randomized Whether or not the PCA step and the within- and between-class scatter eigendecompositions stream the training data and use randomized subspace iteration. See PCATransform.
  */
 class LDATransform : public Transform
 {
@@ -243,6 +534,7 @@ class LDATransform : public Transform
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(bool isBinary READ get_isBinary WRITE set_isBinary RESET reset_isBinary STORED false)
     Q_PROPERTY(bool normalize READ get_normalize WRITE set_normalize RESET reset_normalize STORED false)
+    Q_PROPERTY(bool randomized READ get_randomized WRITE set_randomized RESET reset_randomized STORED false)
     BR_PROPERTY(float, pcaKeep, 0.98)
     BR_PROPERTY(bool, pcaWhiten, false)
     BR_PROPERTY(int, directLDA, 0)
@@ -250,6 +542,7 @@ class LDATransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(bool, isBinary, false)
     BR_PROPERTY(bool, normalize, true)
+    BR_PROPERTY(bool, randomized, false)
 
     int dimsOut;
     Eigen::VectorXf mean;
@@ -266,6 +559,7 @@ class LDATransform : public Transform
         PCATransform pca;
         pca.keep = pcaKeep;
         pca.whiten = pcaWhiten;
+        pca.randomized = randomized;
         pca.train(trainingSet);
         mean = pca.mean;
 
@@ -280,18 +574,17 @@ class LDATransform : public Transform
         QMap<int, int> classCounts = trainingSet.countValues<int>("Label");
         const int numClasses = classCounts.size();
 
-        // Map Eigen into OpenCV
-        Eigen::MatrixXd data = Eigen::MatrixXd(dimsIn, instances);
-        for (int i=0; i<instances; i++)
-            data.col(i) = Eigen::Map<const Eigen::MatrixXf>(ldaTrainingSet[i].m().ptr<float>(), dimsIn, 1).cast<double>();
+        // Map Eigen into OpenCV, class means are removed as the within-class scatter is computed
+        ScatterColumns data(ldaTrainingSet);
+        data.groups = classes;
 
-        // Removing class means
-        Eigen::MatrixXd classMeans = Eigen::MatrixXd::Zero(dimsIn, numClasses);
-        for (int i=0; i<instances; i++)  classMeans.col(classes[i]) += data.col(i);
+        Eigen::MatrixXd &classMeans = data.groupMeans;
+        classMeans = Eigen::MatrixXd::Zero(dimsIn, numClasses);
+        for (int i=0; i<instances; i++)  classMeans.col(classes[i]) += Eigen::Map<const Eigen::VectorXf>(data.columns[i], dimsIn).cast<double>();
         for (int i=0; i<numClasses; i++) classMeans.col(i) /= classCounts[i];
-        for (int i=0; i<instances; i++)  data.col(i) -= classMeans.col(classes[i]);
 
         PCATransform space1;
+        space1.randomized = randomized;
 
         if (!directLDA)
         {
@@ -387,6 +680,7 @@ class LDATransform : public Transform
         // but one degree of freedom is lost removing the global mean.
         int dim2 = std::min((int)space1.keep, numClasses-1);
         PCATransform space2;
+        space2.randomized = randomized;
         space2.keep = dim2;
         space2.trainCore(data2);
 
@@ -444,6 +738,19 @@ class LDATransform : public Transform
             dst.m().at<float>(0,0) = dst.m().at<float>(0,0) / stdDev;
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        const int offset = dst.size();
+        if (!projectBlocks(projection, mean, src, dst)) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        if (normalize && isBinary)
+            for (int i=offset; i<dst.size(); i++)
+                dst[i].m().at<float>(0,0) = dst[i].m().at<float>(0,0) / stdDev;
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
@@ -59,6 +59,11 @@ class RandomCentroidsTransform : public Transform
         reindex();
     }
 
+    int trainingSamples() const
+    {
+        return kTrain;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         QMutexLocker locker(&mutex);
@@ -127,6 +127,8 @@ class IndependentTransform : public MetaTransform
     }
 
     bool timeVarying() const { return transform->timeVarying(); }
+    int trainingSamples() const { return transform->trainingSamples(); }
+    int tileRadius() const { return transform->tileRadius(); }
 
     static void _train(Transform *transform, const TemplateList *data)
     {
@@ -169,6 +171,45 @@ class IndependentTransform : public MetaTransform
         dst.append(mats);
     }
 
+    // Projects each matrix index as one list, so transforms with a block project(TemplateList) see whole blocks
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        int mats = 0;
+        foreach (const Template &t, src)
+            mats = std::max(mats, t.size());
+
+        QList<TemplateList> outputs;
+        for (int i=0; i<mats; i++) {
+            TemplateList input;
+            foreach (const Template &t, src)
+                if (i < t.size())
+                    input.append(Template(t.file, t[i]));
+
+            TemplateList output;
+            transforms[i%transforms.size()]->project(input, output);
+            if (output.size() != input.size()) {
+                // Not a per-template transform, fall back to projecting each template through every index
+                Transform::project(src, dst);
+                return;
+            }
+            outputs.append(output);
+        }
+
+        QVector<int> next(mats, 0);
+        foreach (const Template &t, src) {
+            Template result(t.file);
+            for (int i=0; i<t.size(); i++) {
+                const Template &output = outputs[i][next[i]++];
+                // Metadata accumulates across indices, and a failure on any index is kept
+                result.file.append(output.file);
+                result.file.fte = result.file.fte || output.file.fte;
+                // A failed matrix is kept as an empty one, as it is when projected alone
+                result.append(output.isEmpty() ? Mat() : output.last());
+            }
+            dst.append(result);
+        }
+    }
+
     void projectUpdate(const Template &src, Template &dst)
     {
         dst.file = src.file;
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QElapsedTimer>
 #include <QtConcurrent>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -26,6 +27,7 @@ namespace br
  * \brief Transforms in series.
  *
  * The source Template is given to the first transform and the resulting Template is passed to the next transform, etc.
+ * Set the global chunkPipes property to run the whole pipe once per chunk of templates rather than once per stage.
  *
  * \author Josh Klontz \cite jklontz
  * \br_related_plugin ExpandTransform ForkTransform
@@ -179,6 +181,58 @@ class PipeTransform : public CompositeTransform
         CompositeTransform::init();
     }
 
+    // Runs of transforms that can be evaluated over bands of an image are fused into a Tile
+    Transform *simplify(bool &newTransform)
+    {
+        Transform *simplified = CompositeTransform::simplify(newTransform);
+        PipeTransform *pipe = dynamic_cast<PipeTransform *>(simplified);
+        if (!pipe)
+            return simplified;
+
+        QList<Transform *> fused;
+        QList<Transform *> tiles;
+        int i = 0;
+        while (i < pipe->transforms.size()) {
+            int j = i;
+            while ((j < pipe->transforms.size()) &&
+                   !pipe->transforms[j]->trainable &&
+                   !pipe->transforms[j]->timeVarying() &&
+                   (pipe->transforms[j]->tileRadius() >= 0))
+                j++;
+
+            if (j - i < 2) {
+                fused.append(pipe->transforms[i]);
+                i++;
+                continue;
+            }
+
+            Transform *tile = Transform::make("Tile", NULL);
+            tile->setPropertyRecursive("transforms", QVariant::fromValue(pipe->transforms.mid(i, j-i)));
+            tile->init();
+            fused.append(tile);
+            tiles.append(tile);
+            i = j;
+        }
+
+        if (tiles.isEmpty())
+            return simplified;
+
+        // Make a copy of the current object to hold the fused transforms, unless simplification already did
+        if (pipe == this) {
+            QList<Transform *> children = transforms;
+            transforms = QList<Transform *>();
+            pipe = dynamic_cast<PipeTransform *>(Transform::make(description(false), NULL));
+            transforms = children;
+            newTransform = true;
+        }
+
+        foreach (Transform *tile, tiles)
+            tile->setParent(pipe);
+        pipe->transforms = fused;
+        pipe->init();
+        return pipe;
+    }
+
     QByteArray likely(const QByteArray &indentation) const
     {
         QByteArray result;
@@ -196,11 +250,50 @@ class PipeTransform : public CompositeTransform
         return result;
     }
 
+    // Run every stage over one chunk of the input on the calling thread
+    void _projectChunk(const TemplateList *src, TemplateList *dst, TemplateList *ftes) const
+    {
+        SerialProjectScope serial;
+        QElapsedTimer timer;
+        timer.start();
+
+        *dst = *src;
+        foreach (const Transform *f, transforms) {
+            TemplateList res;
+            f->project(*dst, res);
+            splitFTEs(res, *ftes);
+            *dst = res;
+        }
+
+        recordProjectCost(timer.nsecsElapsed(), src->size());
+    }
+
 protected:
     // Template list project -- process templates in parallel through Transform::project
     // or if parallelism is disabled, handle them sequentially
    void _project(const TemplateList &src, TemplateList &dst) const
     {
+        // Opt-in: schedule the whole pipe once per chunk instead of once per stage per template
+        if (Globals->chunkPipes && (Globals->parallelism > 1) && (src.size() > 1) && !SerialProjectScope::active()) {
+            const int chunkSize = projectChunkSize(src.size());
+            QList<TemplateList> chunks;
+            for (int i=0; i<src.size(); i+=chunkSize)
+                chunks.append(src.mid(i, chunkSize));
+
+            QVector<TemplateList> results(chunks.size()), ftes(chunks.size());
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<chunks.size(); i++)
+                futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectChunk, &chunks[i], &results[i], &ftes[i]));
+            futures.waitForFinished();
+
+            dst.clear();
+            foreach (const TemplateList &result, results)
+                dst.append(result);
+            foreach (const TemplateList &fte, ftes)
+                dst.append(fte);
+            return;
+        }
+
         TemplateList ftes;
         dst = src;
         foreach (const Transform *f, transforms) {
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#include <QCoreApplication>
 #include <QReadWriteLock>
 #include <QWaitCondition>
 #include <QThreadPool>
@@ -925,14 +926,19 @@ public:
 
     void subProject(QList<TemplateList> &data, int end_idx)
     {
-        if (end_idx == 0)
+        subProject(data, 0, end_idx);
+    }
+
+    void subProject(QList<TemplateList> &data, int start_idx, int end_idx)
+    {
+        if (end_idx == start_idx)
             return;
 
         CollectSets collector;
 
-        // Set transforms to the start, up to end_idx
+        // Set transforms to start_idx, up to end_idx
         QList<Transform *> backup = this->transforms;
-        transforms = backup.mid(0,end_idx);
+        transforms = backup.mid(start_idx, end_idx - start_idx);
         // We use collector to retain the project structure at the end of the
         // truncated stream.
         transforms.append(&collector);
@@ -968,6 +974,12 @@ public:
             }
         }
 
+        if (Globals->streamTraining) {
+            trainSpilled(separated);
+            init();
+            return;
+        }
+
         for (int i=0; i < transforms.size(); i++) {
             // OK we have a trainable transform, we need to get input data for it.
             if (transforms[i]->trainable) {
@@ -982,6 +994,148 @@ public:
         init();
     }
 
+    // Streaming counterpart of train(), used when Globals->streamTraining is set.
+    // Rather than re-projecting the whole training set from the first stage for
+    // every trainable transform, the input to each trainable stage is projected
+    // a block at a time from the previous stage's spill gallery into a new one,
+    // and only the sets that stage consumes are read back into memory.
+    void trainSpilled(const QList<TemplateList> &data)
+    {
+        // The spill gallery holds the input to transforms[spillStage],
+        // stage zero reads the raw training data directly.
+        QString spill;
+        int spillStage = 0, spillSets = data.size();
+
+        for (int i=0; i < transforms.size(); i++) {
+            if (!transforms[i]->trainable)
+                continue;
+
+            if (i > spillStage) {
+                const QString next = spillName(i);
+                int nextSets = 0;
+                {
+                    QScopedPointer<Gallery> output(Gallery::make(next));
+                    if (spillStage == 0) {
+                        for (int j=0; j < data.size(); j += Globals->blockSize)
+                            spillBlock(data.mid(j, Globals->blockSize), 0, i, output.data(), nextSets);
+                    } else if (spillSets > 0) {
+                        QScopedPointer<Gallery> input(Gallery::make(spill));
+                        TemplateList pending;
+                        bool done = false;
+                        while (!done)
+                            spillBlock(readSpill(input.data(), pending, &done), spillStage, i, output.data(), nextSets);
+                    }
+                }
+
+                if (!spill.isEmpty())
+                    QFile::remove(spill);
+                spill = next;
+                spillStage = i;
+                spillSets = nextSets;
+            }
+
+            const int samples = transforms[i]->trainingSamples();
+            if (spillStage == 0) {
+                if ((samples <= 0) || (samples >= data.size())) {
+                    transforms[i]->train(data);
+                } else {
+                    QList<TemplateList> sampled;
+                    foreach (int index, Common::RandSample(samples, data.size(), 0, true))
+                        sampled.append(data[index]);
+                    transforms[i]->train(sampled);
+                }
+            } else {
+                transforms[i]->train(loadSpill(spill, spillSets, samples, i));
+            }
+        }
+
+        if (!spill.isEmpty())
+            QFile::remove(spill);
+    }
+
+    QString spillName(int stage) const
+    {
+        return QString("%1/spill/%2-%3-%4.gal").arg(Globals->scratchPath(),
+                                                     QString::number(QCoreApplication::applicationPid()),
+                                                     QString::number(quintptr(this), 16),
+                                                     QString::number(stage));
+    }
+
+    // Projects a block of sets through transforms [start_idx, end_idx) and
+    // appends the output sets to a spill gallery, tagging each template with
+    // the index of the set it belongs to.
+    void spillBlock(QList<TemplateList> block, int start_idx, int end_idx, Gallery *output, int &sets)
+    {
+        subProject(block, start_idx, end_idx);
+        foreach (const TemplateList &set, block) {
+            if (set.isEmpty())
+                continue;
+            foreach (Template t, set) {
+                t.file.set("SpillSet", sets);
+                output->write(t);
+            }
+            sets++;
+        }
+    }
+
+    // Reads the next block of sets back from a spill gallery. The last set of
+    // a block may continue into the next one, so it is held in pending until
+    // the following call.
+    static QList<TemplateList> readSpill(Gallery *spill, TemplateList &pending, bool *done)
+    {
+        TemplateList templates = pending;
+        templates.append(spill->readBlock(done));
+        pending.clear();
+
+        QList<TemplateList> sets;
+        int current = -1;
+        foreach (const Template &t, templates) {
+            const int set = t.file.get<int>("SpillSet");
+            if (set != current) {
+                sets.append(TemplateList());
+                current = set;
+            }
+            sets.last().append(t);
+        }
+
+        if (!*done && !sets.isEmpty())
+            pending = sets.takeLast();
+
+        for (int i=0; i < sets.size(); i++)
+            for (int j=0; j < sets[i].size(); j++)
+                sets[i][j].file.remove("SpillSet");
+        return sets;
+    }
+
+    // Loads the sets in a spill gallery, keeping a uniform random sample of
+    // them (reservoir sampling) when the consuming transform only needs that many.
+    // The sample is drawn from a generator seeded with the stage, so it is reproducible.
+    static QList<TemplateList> loadSpill(const QString &spill, int sets, int samples, int stage)
+    {
+        QList<TemplateList> loaded;
+        if (sets == 0)
+            return loaded;
+
+        QScopedPointer<Gallery> input(Gallery::make(spill));
+        TemplateList pending;
+        bool done = false;
+        int seen = 0;
+        RNG rng(stage);
+        while (!done) {
+            foreach (const TemplateList &set, readSpill(input.data(), pending, &done)) {
+                if ((samples <= 0) || (loaded.size() < samples)) {
+                    loaded.append(set);
+                } else {
+                    const int index = rng.uniform(0, seen + 1);
+                    if (index < samples)
+                        loaded[index] = set;
+                }
+                seen++;
+            }
+        }
+        return loaded;
+    }
+
     bool timeVarying() const { return true; }
 
     void project(const Template &src, Template &dst) const
@@ -0,0 +1,103 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Transforms in series, evaluated over horizontal bands of the image.
+ *
+ * Every transform must report a non-negative Transform::tileRadius(). Each band of output rows is computed from the
+ * input rows it depends on, so intermediate images are band sized and stay in cache instead of spanning the whole image.
+ * Band edges on the image boundary see the same borders as the whole image would, so the output is identical to
+ * projecting through the transforms one after the other. PipeTransform::simplify substitutes this for runs of such transforms.
+ *
+ * \br_property int tileRows Output rows per band.
+ * \br_related_plugin PipeTransform
+ */
+class TileTransform : public CompositeTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int tileRows READ get_tileRows WRITE set_tileRows RESET reset_tileRows STORED false)
+    BR_PROPERTY(int, tileRows, 32)
+
+    int radius;
+
+    void init()
+    {
+        radius = 0;
+        foreach (const Transform *transform, transforms) {
+            if (transform->tileRadius() < 0)
+                qFatal("%s can not be evaluated in bands.", qPrintable(transform->description()));
+            radius += transform->tileRadius();
+        }
+        CompositeTransform::init();
+    }
+
+    int tileRadius() const
+    {
+        return radius;
+    }
+
+protected:
+    void _project(const TemplateList &src, TemplateList &dst) const
+    {
+        Transform::project(src, dst);
+    }
+
+    void _project(const Template &src, Template &dst) const
+    {
+        const int rows = (src.size() == 1) ? src.m().rows : 0;
+
+        // Bands would mostly be padding, process the image whole
+        if (rows <= tileRows + 2*radius) {
+            dst = src;
+            foreach (const Transform *f, transforms)
+                dst >> *f;
+            return;
+        }
+
+        Mat output;
+        for (int begin=0; begin<rows; begin+=tileRows) {
+            const int end = std::min(begin + tileRows, rows);
+            const int bandBegin = std::max(0, begin - radius);
+            const int bandEnd = std::min(rows, end + radius);
+
+            Template band(src.file, src.m().rowRange(bandBegin, bandEnd));
+            foreach (const Transform *f, transforms)
+                band >> *f;
+            if ((band.size() != 1) || (band.m().rows != bandEnd - bandBegin))
+                qFatal("Transforms evaluated in bands must preserve image height.");
+
+            if (output.empty())
+                output.create(rows, band.m().cols, band.m().type());
+            band.m().rowRange(begin - bandBegin, end - bandBegin).copyTo(output.rowRange(begin, end));
+        }
+
+        dst = Template(src.file, output);
+    }
+};
+
+BR_REGISTER(Transform, TileTransform)
+
+} // namespace br
+
+#include "core/tile.moc"
@@ -93,6 +93,15 @@ private:
         return negLogPlusOne ? -log(result+1) : result;
     }
 
+    // Single matrix templates are compared directly, skipping the per-pair dispatch through Distance::compare(Template, Template)
+    void compare(const TemplateList &targets, const Template &query, float *scores) const
+    {
+        for (int j=0; j<targets.size(); j++) {
+            if ((targets[j].size() == 1) && (query.size() == 1)) scores[j] = DistDistance::compare(targets[j].m(), query.m());
+            else                                                 scores[j] = Distance::compare(targets[j], query);
+        }
+    }
+
     static float cosine(const Mat &a, const Mat &b)
     {
         float dot = 0;
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <algorithm>
 #include <numeric>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -91,6 +92,89 @@ private:
         }
         return 0;
     }
+
+    // Splits the targets by matrix so each child can score a row at once
+    struct SplitTargets
+    {
+        QList<int> indices; // Targets with one matrix per distance
+        QList<TemplateList> matrices;
+    };
+
+    SplitTargets split(const TemplateList &targets) const
+    {
+        SplitTargets split;
+        for (int i=0; i<distances.size(); i++)
+            split.matrices.append(TemplateList());
+        for (int j=0; j<targets.size(); j++) {
+            if (targets[j].size() != distances.size())
+                continue;
+            split.indices.append(j);
+            for (int i=0; i<distances.size(); i++)
+                split.matrices[i].append(Template(targets[j].file, targets[j][i]));
+        }
+        return split;
+    }
+
+    void compare(const SplitTargets &split, int size, const Template &query, float *scores) const
+    {
+        std::fill(scores, scores + size, -std::numeric_limits<float>::max());
+        if (query.size() != distances.size())
+            return;
+
+        const int n = split.indices.size();
+        QVector<double> fused(n, (operation == Min) ? std::numeric_limits<double>::max() : (operation == Max) ? -std::numeric_limits<double>::max() : 0);
+        QVector<float> row(n);
+        int count = 0;
+        for (int i=0; i<distances.size(); i++) {
+            const float weight = weights.isEmpty() ? 1 : weights[i];
+            if (weight == 0)
+                continue;
+
+            distances[i]->compare(split.matrices[i], Template(query.file, query[i]), row.data());
+            switch (operation) {
+              case Mean:
+              case Sum:
+                for (int j=0; j<n; j++) fused[j] += weight*row[j];
+                break;
+              case Min:
+                for (int j=0; j<n; j++) fused[j] = std::min(fused[j], double(weight*row[j]));
+                break;
+              case Max:
+                for (int j=0; j<n; j++) fused[j] = std::max(fused[j], double(weight*row[j]));
+                break;
+              default:
+                qFatal("Invalid operation.");
+            }
+            count++;
+        }
+
+        for (int j=0; j<n; j++)
+            scores[split.indices[j]] = (operation == Mean) ? fused[j] / (float)count : fused[j];
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores(targets.size());
+        compare(targets, query, scores.data());
+        return scores.toList();
+    }
+
+    void compare(const TemplateList &targets, const Template &query, float *scores) const
+    {
+        compare(split(targets), targets.size(), query, scores);
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        // Targets are split once for the whole block
+        const SplitTargets targets = split(target);
+        QVector<float> scores(target.size());
+        for (int i=0; i<query.size(); i++) {
+            compare(targets, target.size(), query[i], scores.data());
+            for (int j=0; j<target.size(); j++)
+                output->setRelative(scores[j], i+queryOffset, j+targetOffset);
+        }
+    }
 };
 
 BR_REGISTER(Distance, FuseDistance)
@@ -24,7 +24,7 @@ namespace br
  * \brief Returns -log(distance(a,b)+1)
  * \author Josh Klontz \cite jklontz
  */
-class NegativeLogPlusOneDistance : public Distance
+class NegativeLogPlusOneDistance : public NormalizationDistance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
@@ -40,9 +40,10 @@ class NegativeLogPlusOneDistance : public Distance
         distance->train(src);
     }
 
-    float compare(const Template &a, const Template &b) const
+    void normalize(float *scores, int size) const
     {
-        return -log(distance->compare(a,b)+1);
+        for (int i=0; i<size; i++)
+            scores[i] = -log(scores[i]+1);
     }
 
     void store(QDataStream &stream) const
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtConcurrent>
+#include <algorithm>
 
 #include <openbr/plugins/openbr_internal.h>
 
@@ -51,6 +52,31 @@ class SumDistance : public ListDistance
 
         return result;
     }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores(targets.size());
+        compare(targets, query, scores.data());
+        return scores.toList();
+    }
+
+    // Each child scores the whole row, once a score is -FLT_MAX it stays that way as in the pairwise case
+    void compare(const TemplateList &targets, const Template &query, float *scores) const
+    {
+        std::fill(scores, scores + targets.size(), 0.f);
+        QVector<float> row(targets.size());
+        foreach (br::Distance *distance, distances) {
+            distance->compare(targets, query, row.data());
+            for (int j=0; j<targets.size(); j++)
+                if (scores[j] != -std::numeric_limits<float>::max())
+                    scores[j] += row[j];
+        }
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        compareRows(target, query, output, targetOffset, queryOffset);
+    }
 };
 
 BR_REGISTER(Distance, SumDistance)
@@ -24,7 +24,7 @@ namespace br
  * \brief Linear normalizes of a Distance so the mean impostor score is 0 and the mean genuine score is 1.
  * \author Josh Klontz \cite jklontz
  */
-class UnitDistance : public Distance
+class UnitDistance : public NormalizationDistance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance)
@@ -74,20 +74,18 @@ class UnitDistance : public Distance
         qDebug("a = %f, b = %f", a, b);
     }
 
-    float compare(const Template &target, const Template &query) const
-    {
-        return normalize(distance->compare(target, query));
-    }
-
     float compare(const cv::Mat &target, const cv::Mat &query) const
     {
-        return normalize(distance->compare(target, query));
+        float score = distance->compare(target, query);
+        normalize(&score, 1);
+        return score;
     }
-	
-	float normalize(float score) const
+
+    void normalize(float *scores, int size) const
     {
-        if (!Globals->scoreNormalization) return score;
-        return a * (score - b);
+        if (!Globals->scoreNormalization) return;
+        for (int i=0; i<size; i++)
+            scores[i] = a * (scores[i] - b);
     }
 };
 
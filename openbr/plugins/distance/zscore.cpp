@@ -25,7 +25,7 @@ namespace br
  *        and standard deviation parameters during training.
  * \author Scott Klum \cite sklum
  */
-class ZScoreDistance : public Distance
+class ZScoreDistance : public NormalizationDistance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
@@ -60,13 +60,14 @@ class ZScoreDistance : public Distance
         if (stddev == 0) qFatal("Stddev is 0.");
     }
 
-    float compare(const Template &target, const Template &query) const
+    void normalize(float *scores, int size) const
     {
-        float score = distance->compare(target,query);
-        if      (score == -std::numeric_limits<float>::max()) score = (min - mean) / stddev;
-        else if (score ==  std::numeric_limits<float>::max()) score = (max - mean) / stddev;
-        else                                                  score = (score - mean) / stddev;
-        return score;
+        for (int i=0; i<size; i++) {
+            float &score = scores[i];
+            if      (score == -std::numeric_limits<float>::max()) score = (min - mean) / stddev;
+            else if (score ==  std::numeric_limits<float>::max()) score = (max - mean) / stddev;
+            else                                                  score = (score - mean) / stddev;
+        }
     }
 
     void store(QDataStream &stream) const
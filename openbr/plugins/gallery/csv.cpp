@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 
@@ -28,20 +30,48 @@ namespace br
  *            The first column in the file should be the path to the file to enroll.
  *            Other columns will be treated as file metadata.
  *
+ * Each block of lines is parsed in parallel. Column types are inferred from the first row,
+ * cells that don't match their column's type fall back to the usual File metadata parsing.
+ *
+ * \br_property bool cache If true, parsed rows are also stored in a binary sidecar (the file name with ".cache" appended), which later reads load from directly while it is newer than the csv. Default is false.
+ *
  * \br_related_plugin txtGallery
  */
 class csvGallery : public FileGallery
 {
     Q_OBJECT
     Q_PROPERTY(bool inPlace READ get_inPlace WRITE set_inPlace RESET reset_inPlace STORED false)
+    Q_PROPERTY(bool cache READ get_cache WRITE set_cache RESET reset_cache STORED false)
     BR_PROPERTY(bool, inPlace, false)
+    BR_PROPERTY(bool, cache, false)
 
     FileList files;
     QStringList headers;
 
+    enum ColumnKind { Text, Integer, Real, Structured };
+    QList<ColumnKind> kinds;
+
+    QFile cacheFile;
+    QDataStream cacheStream;
+    bool fromCache;
+    qint64 cachePosition;
+
+    struct Range
+    {
+        const csvGallery *gallery;
+        const QList<QByteArray> *lines;
+        const QList<qint64> *positions;
+        int begin, end;
+    };
+
     ~csvGallery()
     {
         f.close();
+
+        // Discard a partially written cache
+        if (cacheFile.isOpen() && (cacheFile.openMode() & QFile::WriteOnly))
+            cacheFile.remove();
+
         if (files.isEmpty()) return;
 
         QSet<QString> samples;
@@ -80,24 +110,208 @@ class csvGallery : public FileGallery
             QString line = QString::fromLocal8Bit(lineBytes).trimmed();
             QRegExp regexp("\\s*,\\s*");
             headers = line.split(regexp);
+            kinds.clear();
+            fromCache = cache && openCache();
+            if (!fromCache && cache)
+                createCache();
+        }
+
+        if (fromCache)
+            return readCache(done);
+
+        // Lines are gathered serially, then parsed in parallel
+        QList<QByteArray> lines;
+        QList<qint64> positions;
+        while ((lines.size() < this->readBlockSize) && !f.atEnd()) {
+            lines.append(f.readLine());
+            positions.append(f.pos());
+        }
+
+        if (kinds.isEmpty())
+            inferKinds(lines);
+
+        const int tasks = (lines.size() < 1024) ? 1 : std::max(1, Globals->parallelism) * 4;
+        QList<Range> ranges;
+        for (int i=0; i<tasks; i++) {
+            Range range;
+            range.gallery = this;
+            range.lines = &lines;
+            range.positions = &positions;
+            range.begin = lines.size() * i / tasks;
+            range.end = lines.size() * (i+1) / tasks;
+            ranges.append(range);
         }
 
-        for (qint64 i = 0; i < this->readBlockSize && !f.atEnd(); i++) {
-            const QVariantList values = parseLine(f.readLine());
+        if (tasks == 1) {
+            templates = parseRange(ranges.first());
+        } else {
+            foreach (const TemplateList &parsed, QtConcurrent::blockingMapped< QList<TemplateList> >(ranges, parseRange))
+                templates.append(parsed);
+        }
+
+        *done = f.atEnd();
+
+        if (cacheFile.isOpen()) {
+            foreach (const Template &t, templates)
+                cacheStream << t.file;
+            if (*done)
+                finishCache();
+        }
+        return templates;
+    }
+
+    qint64 position()
+    {
+        return fromCache ? cachePosition : f.pos();
+    }
+
+    // The type of each column is taken from the first complete row
+    void inferKinds(const QList<QByteArray> &lines)
+    {
+        foreach (const QByteArray &line, lines) {
+            const QVariantList values = parseLine(line);
+            if (values.size() != headers.size()) continue;
+
+            kinds.append(Text); // File name
+            for (int j=1; j<values.size(); j++) {
+                const QString value = values[j].toString();
+                const QVariant variant = File::parse(value);
+                if (value.startsWith('['))                      kinds.append(Structured);
+                else if (variant.type() == QVariant::Int)       kinds.append(Integer);
+                else if (variant.userType() == QMetaType::Float) kinds.append(Real);
+                else if (variant.type() == QVariant::String)    kinds.append(Text);
+                else                                            kinds.append(Structured);
+            }
+            return;
+        }
+    }
+
+    // Equivalent to File::set(key, value), but only tries the parse the column calls for
+    static void setField(File &file, const QString &key, const QString &value, ColumnKind kind)
+    {
+        bool ok = false;
+        if ((kind == Integer) || (kind == Real)) {
+            const int i = value.toInt(&ok);
+            if (ok) {
+                file.set(key, QVariant(i));
+                return;
+            }
+            if (kind == Real) {
+                const float f = value.toFloat(&ok);
+                if (ok) {
+                    file.set(key, QVariant(f));
+                    return;
+                }
+            }
+        } else if (kind == Text) {
+            // Anything File::parse wouldn't leave as a string starts with a bracket or is numeric
+            if (!value.startsWith('(') && !value.startsWith('[') && !value.startsWith("RotatedRect(")) {
+                value.toFloat(&ok);
+                if (!ok) {
+                    file.set(key, QVariant(value));
+                    return;
+                }
+            }
+        }
+
+        file.set(key, value);
+    }
+
+    static TemplateList parseRange(const Range &range)
+    {
+        const QStringList &headers = range.gallery->headers;
+        const QList<ColumnKind> &kinds = range.gallery->kinds;
+
+        TemplateList templates;
+        for (int i=range.begin; i<range.end; i++) {
+            const QVariantList values = parseLine(range.lines->at(i));
             if (values.size() != headers.size()) continue;
 
             File in;
             for (int j=0; j<values.size(); j++) {
                 if (j == 0) in.name = values[j].toString();
-                else        in.set(headers[j], values[j].toString());
+                else        setField(in, headers[j], values[j].toString(), kinds.value(j, Structured));
             }
-            in.set("progress", f.pos());
+            in.set("progress", range.positions->at(i));
             templates.append(in);
         }
-        *done = f.atEnd();
         return templates;
     }
 
+    QString cacheName() const
+    {
+        return file.name + ".cache";
+    }
+
+    // The cache records the size and modification time of the csv it was made from
+    bool openCache()
+    {
+        const QFileInfo csvInfo(file.name), cacheInfo(cacheName());
+        if (!cacheInfo.exists() || (cacheInfo.lastModified() < csvInfo.lastModified()))
+            return false;
+
+        cacheFile.setFileName(cacheName());
+        if (!cacheFile.open(QFile::ReadOnly))
+            return false;
+        cacheStream.setDevice(&cacheFile);
+
+        qint64 size, modified;
+        QStringList cachedHeaders;
+        cacheStream >> size >> modified >> cachedHeaders;
+        if ((cacheStream.status() != QDataStream::Ok) ||
+            (size != csvInfo.size()) ||
+            (modified != csvInfo.lastModified().toMSecsSinceEpoch()) ||
+            (cachedHeaders != headers)) {
+            cacheFile.close();
+            return false;
+        }
+
+        cachePosition = f.pos();
+        return true;
+    }
+
+    TemplateList readCache(bool *done)
+    {
+        TemplateList templates;
+        while ((templates.size() < this->readBlockSize) && !cacheStream.atEnd()) {
+            File in;
+            cacheStream >> in;
+            templates.append(in);
+        }
+
+        if (!templates.isEmpty())
+            cachePosition = templates.last().file.get<qint64>("progress", cachePosition);
+
+        *done = cacheStream.atEnd();
+        if (*done) {
+            cacheFile.close();
+            cachePosition = f.size();
+        }
+        return templates;
+    }
+
+    // Written to a temporary name and moved into place once the whole csv has been read
+    void createCache()
+    {
+        cacheFile.setFileName(cacheName() + ".tmp");
+        if (!cacheFile.open(QFile::WriteOnly)) {
+            qWarning("Failed to create %s", qPrintable(cacheFile.fileName()));
+            return;
+        }
+        cacheStream.setDevice(&cacheFile);
+
+        const QFileInfo csvInfo(file.name);
+        cacheStream << csvInfo.size() << csvInfo.lastModified().toMSecsSinceEpoch() << headers;
+    }
+
+    void finishCache()
+    {
+        cacheFile.close();
+        QFile::remove(cacheName());
+        if (!QFile::rename(cacheFile.fileName(), cacheName()))
+            qWarning("Failed to write %s", qPrintable(cacheName()));
+    }
+
     void write(const Template &t)
     {
         if (inPlace) {
@@ -128,6 +342,13 @@ class csvGallery : public FileGallery
         return words.join(",");
     }
 
+    void init()
+    {
+        fromCache = false;
+        cachePosition = 0;
+        FileGallery::init();
+    }
+
     static QVariantList parseLine(const QByteArray bytes)
     {
         bool inQuote(false);
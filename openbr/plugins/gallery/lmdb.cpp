@@ -3,6 +3,7 @@
 #include <openbr/core/qtutils.h>
 
 #include <QFutureSynchronizer>
+#include <QtConcurrentMap>
 #include <QtConcurrentRun>
 #include <QMutexLocker>
 #include <QWaitCondition>
@@ -12,68 +13,108 @@
 
 using namespace br;
 
+// Caffe stores pixels channel-major (all of channel 0, then channel 1, ...),
+// OpenCV interleaves them. cv::merge and cv::split do the conversion with
+// vectorized copies, one plane per channel viewing the channel-major buffer.
+static cv::Mat fromChannelMajor(const uchar *data, int rows, int cols, int channels, int depth)
+{
+    const size_t planeSize = size_t(rows) * cols * CV_ELEM_SIZE1(depth);
+    std::vector<cv::Mat> planes;
+    for (int c=0; c<channels; c++)
+        planes.push_back(cv::Mat(rows, cols, CV_MAKETYPE(depth, 1), (void*) (data + c*planeSize)));
+
+    cv::Mat m;
+    cv::merge(planes, m);
+    return m;
+}
+
+static void toChannelMajor(const cv::Mat &m, uchar *data)
+{
+    const size_t planeSize = size_t(m.rows) * m.cols * m.elemSize1();
+    std::vector<cv::Mat> planes;
+    for (int c=0; c<m.channels(); c++)
+        planes.push_back(cv::Mat(m.rows, m.cols, CV_MAKETYPE(m.depth(), 1), data + c*planeSize));
+
+    // split() writes into the preallocated planes since their size and type already match
+    cv::split(m, planes);
+}
+
 class lmdbGallery : public Gallery
 {
     Q_OBJECT
     Q_PROPERTY(bool remap READ get_remap WRITE set_remap RESET reset_remap STORED false)
     BR_PROPERTY(bool, remap, true)
 
-    TemplateList readBlock(bool *done)
+    struct Record
     {
-        *done = false;
-        if (!initialized) {
-            db = QSharedPointer<caffe::db::DB>(caffe::db::GetDB("lmdb"));
-            db->Open(file.name.toStdString(),caffe::db::READ);
-            cursor = QSharedPointer<caffe::db::Cursor>(db->NewCursor());
-            initialized = true;
+        std::string key, value;
+    };
+
+    // Read the next block of raw records from the cursor, run on a
+    // background thread while the previous block is being decoded and used
+    QList<Record> fetch()
+    {
+        QList<Record> records;
+        while ((records.size() < readBlockSize) && cursor->valid()) {
+            Record record;
+            record.key = cursor->key();
+            record.value = cursor->value();
+            records.append(record);
+            cursor->Next();
         }
+        return records;
+    }
 
+    static Template decode(const Record &record)
+    {
         caffe::Datum datum;
-        datum.ParseFromString(cursor->value());
+        datum.ParseFromString(record.value);
 
         cv::Mat img;
-        if (datum.encoded()) {
+        if (datum.encoded())
             img = caffe::DecodeDatumToCVMatNative(datum);
-        }
-        else {
-            // create output image of appropriate size
-            img.create(datum.height(), datum.width(), CV_MAKETYPE(CV_8U, datum.channels()));
-            // copy matrix data from datum.
-            for (int h = 0; h < datum.height(); ++h) {
-                uchar* ptr = img.ptr<uchar>(h);
-                int img_index = 0;
-                for (int w = 0; w < datum.width(); ++w) {
-                    for (int c = 0; c < datum.channels(); ++c) {
-                        int datum_index = (c * datum.height() + h) * datum.width() + w;
-                        ptr[img_index++] = (unsigned char)datum.data()[datum_index];
-                    }
-                }
-            }
-        }
+        else if (datum.float_data_size() > 0)
+            img = fromChannelMajor((const uchar*) datum.float_data().data(), datum.height(), datum.width(), datum.channels(), CV_32F);
+        else
+            img = fromChannelMajor((const uchar*) datum.data().data(), datum.height(), datum.width(), datum.channels(), CV_8U);
 
         // We acquired the image data, now decode filename from db key
-        QString baseKey = cursor->key().c_str();
+        QString baseKey = record.key.c_str();
 
         int idx = baseKey.indexOf("_");
         if (idx != -1)
             baseKey = baseKey.right(baseKey.size() - idx - 1);
 
-        TemplateList output;
-        output.append(Template(img));
-        output.last().file.name = baseKey;
-        output.last().file.set("Label", datum.label());
+        Template t(img);
+        t.file.name = baseKey;
+        t.file.set("Label", datum.label());
+        return t;
+    }
 
-        cursor->Next();
+    TemplateList readBlock(bool *done)
+    {
+        if (!initialized) {
+            db = QSharedPointer<caffe::db::DB>(caffe::db::GetDB("lmdb"));
+            db->Open(file.name.toStdString(),caffe::db::READ);
+            cursor = QSharedPointer<caffe::db::Cursor>(db->NewCursor());
+            initialized = true;
+            prefetch = QtConcurrent::run(this, &lmdbGallery::fetch);
+        }
+
+        const QList<Record> records = prefetch.result();
 
-        if (!cursor->valid())
-            *done = true;
+        // The fetch has finished, so the cursor is ours to check before starting the next one
+        *done = !cursor->valid();
+        if (!*done)
+            prefetch = QtConcurrent::run(this, &lmdbGallery::fetch);
 
-        return output;
+        return QtConcurrent::blockingMapped<TemplateList>(records, &lmdbGallery::decode);
     }
 
     bool initialized;
     QSharedPointer<caffe::db::DB> db;
     QSharedPointer<caffe::db::Cursor> cursor;
+    QFuture<QList<Record> > prefetch;
 
     QFutureSynchronizer<void> aThread;
     QMutex dataLock;
@@ -116,16 +157,20 @@ class lmdbGallery : public Gallery
                 caffe::Datum datum;
 
                 const cv::Mat &m = t.m();
+                datum.set_channels(m.channels());
+                datum.set_height(m.rows);
+                datum.set_width(m.cols);
                 if (m.depth() == CV_32F) {
-                    datum.set_channels(m.channels());
-                    datum.set_height(m.rows);
-                    datum.set_width(m.cols);
-                    for (int i=0; i<m.channels(); i++) // Follow Caffe's channel-major ordering convention
-                        for (int j=0; j<m.rows; j++)
-                            for (int k=0; k<m.cols; k++)
-                                datum.add_float_data(m.ptr<float>(j)[k*m.channels()+i]);
+                    // Follow Caffe's channel-major ordering convention
+                    datum.mutable_float_data()->Resize(int(m.total() * m.channels()), 0);
+                    toChannelMajor(m, (uchar*) datum.mutable_float_data()->mutable_data());
                 } else {
-                    caffe::CVMatToDatum(m, &datum);
+                    if (m.depth() != CV_8U)
+                        qFatal("lmdbGallery can only store 8-bit or float matrices.");
+                    std::string buffer(m.total() * m.channels(), 0);
+                    toChannelMajor(m, (uchar*) &buffer[0]);
+                    datum.set_encoded(false);
+                    datum.set_data(buffer);
                 }
 
                 QVariant base_label = t.file.value("Label");
@@ -173,6 +218,8 @@ class lmdbGallery : public Gallery
 
     ~lmdbGallery()
     {
+        prefetch.waitForFinished();
+
         if (initialized) {
             QMutexLocker lock(&dataLock);
             should_end = true;
@@ -0,0 +1,223 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief A gallery split across several shard galleries, described by a manifest.
+ * \br_format One line per shard, paths are relative to the manifest:
+ *
+ * <SHARD_FILE> <COUNT> <HASH_BEGIN> <HASH_END>
+ * <SHARD_FILE> <COUNT> <HASH_BEGIN> <HASH_END>
+ * ...
+ *
+ * When written, each template is routed to the shard whose inclusive [HASH_BEGIN, HASH_END] range contains the
+ * 32-bit FNV-1a hash of its file name, so a template always lands in the same shard regardless of which job enrolled it.
+ * The manifest is written once the gallery is closed.
+ *
+ * When read, shards are visited in manifest order, which makes the sharded gallery equivalent to the concatenation
+ * of its shards. A contiguous shard range can be selected, e.g. <tt>br -compare targets.shards[begin=4,end=8] query.gal</tt>,
+ * so independent jobs can each compare against a slice of a large gallery without coordinating.
+ * Concatenating the outputs of jobs covering consecutive ranges reproduces the unsharded comparison column order.
+ * When a sharded target gallery is compared to a .mtx output, each shard in the range is compared in turn and its scores
+ * are merged into its columns of the output in manifest order, so only one shard is held in memory at a time.
+ *
+ * \br_property int shards Number of shards to create when writing.
+ * \br_property QString format Gallery suffix used for shard files when writing.
+ * \br_property int begin First shard to read (inclusive).
+ * \br_property int end Last shard to read (exclusive), -1 reads through the final shard.
+ */
+class shardsGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int shards READ get_shards WRITE set_shards RESET reset_shards STORED false)
+    Q_PROPERTY(QString format READ get_format WRITE set_format RESET reset_format STORED false)
+    Q_PROPERTY(int begin READ get_begin WRITE set_begin RESET reset_begin STORED false)
+    Q_PROPERTY(int end READ get_end WRITE set_end RESET reset_end STORED false)
+    BR_PROPERTY(int, shards, 16)
+    BR_PROPERTY(QString, format, "gal")
+    BR_PROPERTY(int, begin, 0)
+    BR_PROPERTY(int, end, -1)
+
+    struct Shard
+    {
+        QString fileName;
+        qint64 count;
+        quint32 hashBegin, hashEnd;
+    };
+
+    QList<Shard> manifest;
+    bool manifestRead;
+    int current;
+    qint64 readCount;
+    QSharedPointer<Gallery> reader;
+    QList< QSharedPointer<Gallery> > writers;
+
+public:
+    shardsGallery() : manifestRead(false), current(0), readCount(0) {}
+
+    ~shardsGallery()
+    {
+        if (writers.isEmpty())
+            return;
+
+        // Flush the shards before publishing a manifest that refers to them
+        writers.clear();
+
+        QStringList lines;
+        foreach (const Shard &shard, manifest)
+            lines.append(QString("%1 %2 %3 %4").arg(QFileInfo(shard.fileName).fileName(), QString::number(shard.count),
+                                                   QString::number(shard.hashBegin), QString::number(shard.hashEnd)));
+        QtUtils::writeFile(file.name, lines);
+    }
+
+    static quint32 hash(const QString &name)
+    {
+        const QByteArray bytes = name.toUtf8();
+        quint32 h = 2166136261u;
+        for (int i = 0; i < bytes.size(); i++) {
+            h ^= quint8(bytes[i]);
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+private:
+    int firstShard() const
+    {
+        return qBound(0, begin, manifest.size());
+    }
+
+    int lastShard() const
+    {
+        return end < 0 ? manifest.size() : qBound(firstShard(), end, manifest.size());
+    }
+
+    void readManifest()
+    {
+        // A gallery being written already holds its manifest
+        if (manifestRead || !writers.isEmpty())
+            return;
+        manifestRead = true;
+
+        const QDir dir = QFileInfo(file.name).dir();
+        foreach (const QString &line, QtUtils::readLines(file.name)) {
+            const QStringList words = line.simplified().split(' ', QString::SkipEmptyParts);
+            if (words.isEmpty() || words.first().startsWith('#'))
+                continue;
+            if (words.size() != 4)
+                qFatal("Malformed shard manifest line '%s' in %s.", qPrintable(line), qPrintable(file.name));
+
+            Shard shard;
+            shard.fileName = dir.filePath(words[0]);
+            shard.count = words[1].toLongLong();
+            shard.hashBegin = words[2].toUInt();
+            shard.hashEnd = words[3].toUInt();
+            manifest.append(shard);
+        }
+        current = firstShard();
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readManifest();
+
+        TemplateList templates;
+        while (templates.isEmpty() && (current < lastShard())) {
+            // Empty shards are never created on disk
+            if (manifest[current].count == 0) {
+                current++;
+                continue;
+            }
+
+            if (!reader) {
+                File shardFile(manifest[current].fileName);
+                shardFile.set("readBlockSize", readBlockSize);
+                reader = QSharedPointer<Gallery>(Gallery::make(shardFile));
+            }
+
+            bool shardDone;
+            templates = reader->readBlock(&shardDone);
+            if (shardDone) {
+                reader.clear();
+                current++;
+            }
+        }
+
+        // Progress is reported in templates across the selected shards, consistent with totalSize()
+        for (int i = 0; i < templates.size(); i++)
+            templates[i].file.set("progress", readCount + i);
+        readCount += templates.size();
+
+        *done = (current >= lastShard());
+        if (*done) {
+            current = firstShard();
+            readCount = 0;
+        }
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (writers.isEmpty()) {
+            if (shards < 1)
+                qFatal("Invalid shard count %d.", shards);
+
+            // Shard i owns the hashes h with floor(h * shards / 2^32) == i
+            const QFileInfo fileInfo(file.name);
+            for (int i = 0; i < shards; i++) {
+                Shard shard;
+                shard.fileName = fileInfo.dir().filePath(QString("%1_%2.%3").arg(fileInfo.completeBaseName(), QString::number(i), format));
+                shard.count = 0;
+                shard.hashBegin = quint32(((quint64(i) << 32) + shards - 1) / shards);
+                shard.hashEnd = quint32(((quint64(i+1) << 32) + shards - 1) / shards - 1);
+                manifest.append(shard);
+                writers.append(QSharedPointer<Gallery>());
+            }
+        }
+
+        const int i = int((quint64(hash(t.file.name)) * quint64(shards)) >> 32);
+        if (!writers[i])
+            writers[i] = QSharedPointer<Gallery>(Gallery::make(manifest[i].fileName));
+        writers[i]->write(t);
+        manifest[i].count++;
+    }
+
+    qint64 totalSize()
+    {
+        readManifest();
+        qint64 total = 0;
+        for (int i = firstShard(); i < lastShard(); i++)
+            total += manifest[i].count;
+        return total;
+    }
+
+    qint64 position()
+    {
+        return readCount;
+    }
+};
+
+BR_REGISTER(Gallery, shardsGallery)
+
+} // namespace br
+
+#include "gallery/shards.moc"
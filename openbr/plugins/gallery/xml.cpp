@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
 #include <QtXml>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -25,6 +26,9 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief A sigset input.
+ *
+ * Each block of signatures is split into byte ranges that are parsed in parallel.
+ *
  * \author Josh Klontz \cite jklontz
  */
 class xmlGallery : public FileGallery
@@ -36,10 +40,16 @@ class xmlGallery : public FileGallery
     BR_PROPERTY(bool, skipMissing, false)
     FileList files;
 
-    QXmlStreamReader reader;
+    QByteArray pending; // Bytes read from f but not yet parsed
+    qint64 pendingOffset; // Position of pending in f
 
-    QString currentSignatureName;
-    bool signatureActive;
+    // A run of complete biometric-signature elements
+    struct Fragment
+    {
+        QByteArray bytes;
+        qint64 progress;
+        bool ignoreMetadata, skipMissing;
+    };
 
     ~xmlGallery()
     {
@@ -48,129 +58,159 @@ class xmlGallery : public FileGallery
             BEE::writeSigset(file, files, ignoreMetadata);
     }
 
-    TemplateList readBlock(bool *done)
+    // Offset of the next biometric-signature start tag in bytes, or -1
+    static int signatureStart(const QByteArray &bytes, int from)
     {
-        if (readOpen())
-            reader.setDevice(&f);
+        static const QByteArray tag("<biometric-signature");
+        while ((from = bytes.indexOf(tag, from)) != -1) {
+            // Don't match biometric-signature-set, or a tag cut off at the end of bytes
+            const int next = from + tag.size();
+            if ((next < bytes.size()) && (bytes[next] != '\0') && (strchr(" \t\r\n>/", bytes[next]) != NULL))
+                return from;
+            from = next;
+        }
+        return -1;
+    }
 
-        if (reader.atEnd())
-            f.seek(0);
+    static TemplateList parseFragment(const Fragment &fragment)
+    {
+        // Wrap the signatures in a root element so they form a document of their own
+        QXmlStreamReader reader("<biometric-signature-set>" + fragment.bytes + "</biometric-signature-set>");
 
         TemplateList templates;
-        qint64 count = 0;
+        QString currentSignatureName;
+        bool signatureActive = false;
 
-        while (!reader.atEnd())
-        {
-            // if an identity is active we try to read presentations
-            if (signatureActive)
-            {
-                while (signatureActive)
-                {
-                    QXmlStreamReader::TokenType signatureToken = reader.readNext();
+        while (!reader.atEnd()) {
+            const QXmlStreamReader::TokenType token = reader.readNext();
 
-                    // did the signature end?
-                    if (signatureToken == QXmlStreamReader::EndElement && reader.name() == "biometric-signature") {
-                        signatureActive = false;
-                        break;
-                    }
-
-                    // did we reach the end of the document? Theoretically this shoudln't happen without reaching the end of
-                    if (signatureToken == QXmlStreamReader::EndDocument)
-                        break;
-
-                    // a presentation!
-                    if (signatureToken == QXmlStreamReader::StartElement && reader.name() == "presentation") {
-                        templates.append(Template(File("",currentSignatureName)));
-                        foreach (const QXmlStreamAttribute &attribute, reader.attributes()) {
-                            // file-name is stored directly on file, not as a key/value pair
-                            if (attribute.name() == "file-name")
-                                templates.last().file.name = attribute.value().toString();
-                            // other values are directly set as metadata
-                            else if (!ignoreMetadata) templates.last().file.set(attribute.name().toString(), attribute.value().toString());
-                        }
-
-                        // a presentation can have bounding boxes as child elements
-                        QList<QRectF> rects = templates.last().file.rects();
-                        while (true)
-                        {
-                            QXmlStreamReader::TokenType pToken = reader.readNext();
-                            if (pToken == QXmlStreamReader::EndElement && reader.name() == "presentation")
-                                break;
-
-                            if (pToken == QXmlStreamReader::StartElement)
-                            {
-                                if (reader.attributes().hasAttribute("x")
-                                    && reader.attributes().hasAttribute("y")
-                                    && reader.attributes().hasAttribute("width")
-                                    && reader.attributes().hasAttribute("height") )
-                                {
-                                    // get bounding box properties as attributes, just going to assume this all works
-                                    qreal x = reader.attributes().value("x").string()->toDouble();
-                                    qreal y = reader.attributes().value("y").string()->toDouble();
-                                    qreal width =  reader.attributes().value("width").string()->toDouble();
-                                    qreal height = reader.attributes().value("height").string()->toDouble();
-                                    rects += QRectF(x, y, width, height);
-                                }
-                            }
-                        }
-                        templates.last().file.setRects(rects);
-                        templates.last().file.set("progress", f.pos());
-
-                        // we read another complete template
-                        count++;
-
-                        // optionally remove templates whose files don't exist or are empty
-                        if (skipMissing && !QFileInfo(templates.last().file.resolved()).size()) {
-                            templates.removeLast();
-                            count--;
-                        }
-                    }
-                }
+            // did the signature end?
+            if (token == QXmlStreamReader::EndElement && reader.name() == "biometric-signature") {
+                signatureActive = false;
+                continue;
             }
-            // otherwise, keep reading elements until the next identity is reacehed
-            else
-            {
-                QXmlStreamReader::TokenType token = reader.readNext();
 
-                // end of file?
-                if (token == QXmlStreamReader::EndDocument)
-                    break;
+            // we are only interested in new elements
+            if (token != QXmlStreamReader::StartElement)
+                continue;
 
-                // we are only interested in new elements
-                if (token != QXmlStreamReader::StartElement)
+            // biometric-signature -- an identity
+            if (reader.name() == "biometric-signature") {
+                // read the name associated with the current signature
+                if (!reader.attributes().hasAttribute("name")) {
+                    qDebug() << "Biometric signature missing name";
                     continue;
+                }
+                currentSignatureName = reader.attributes().value("name").toString();
+                signatureActive = true;
+                continue;
+            }
 
-                QStringRef elName = reader.name();
+            // a presentation!
+            if (!signatureActive || (reader.name() != "presentation"))
+                continue;
+
+            templates.append(Template(File("",currentSignatureName)));
+            foreach (const QXmlStreamAttribute &attribute, reader.attributes()) {
+                // file-name is stored directly on file, not as a key/value pair
+                if (attribute.name() == "file-name")
+                    templates.last().file.name = attribute.value().toString();
+                // other values are directly set as metadata
+                else if (!fragment.ignoreMetadata) templates.last().file.set(attribute.name().toString(), attribute.value().toString());
+            }
 
-                // biometric-signature-set is the root element
-                if (elName == "biometric-signature-set")
-                    continue;
+            // a presentation can have bounding boxes as child elements
+            QList<QRectF> rects = templates.last().file.rects();
+            while (!reader.atEnd())
+            {
+                QXmlStreamReader::TokenType pToken = reader.readNext();
+                if (pToken == QXmlStreamReader::EndElement && reader.name() == "presentation")
+                    break;
 
-                // biometric-signature -- an identity
-                if (elName == "biometric-signature")
+                if (pToken == QXmlStreamReader::StartElement)
                 {
-                    // read the name associated with the current signature
-                    if (!reader.attributes().hasAttribute("name"))
+                    if (reader.attributes().hasAttribute("x")
+                        && reader.attributes().hasAttribute("y")
+                        && reader.attributes().hasAttribute("width")
+                        && reader.attributes().hasAttribute("height") )
                     {
-                        qDebug() << "Biometric signature missing name";
-                        continue;
-                    }
-                    currentSignatureName = reader.attributes().value("name").toString();
-                    signatureActive = true;
-
-                    // If we've already read enough templates for this block, then break here.
-                    // We wait untill the start of the next signature to be sure that done should
-                    // actually be false (i.e. there are actually items left in this file)
-                    if (count >= this->readBlockSize) {
-                        *done = false;
-                        return templates;
+                        // get bounding box properties as attributes, just going to assume this all works
+                        qreal x = reader.attributes().value("x").string()->toDouble();
+                        qreal y = reader.attributes().value("y").string()->toDouble();
+                        qreal width =  reader.attributes().value("width").string()->toDouble();
+                        qreal height = reader.attributes().value("height").string()->toDouble();
+                        rects += QRectF(x, y, width, height);
                     }
-
                 }
             }
+            templates.last().file.setRects(rects);
+            templates.last().file.set("progress", fragment.progress);
+
+            // optionally remove templates whose files don't exist or are empty
+            if (fragment.skipMissing && !QFileInfo(templates.last().file.resolved()).size())
+                templates.removeLast();
+        }
+
+        return templates;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (readOpen() || (f.atEnd() && pending.isEmpty())) {
+            f.seek(0);
+            pending.clear();
+            pendingOffset = 0;
+        }
+
+        // Locate the next readBlockSize signatures, and the start of the one after them
+        QList<int> starts;
+        int from = 0;
+        while (true) {
+            int start;
+            while ((starts.size() <= this->readBlockSize) && ((start = signatureStart(pending, from)) != -1)) {
+                starts.append(start);
+                from = start + 1;
+            }
+            if ((starts.size() > this->readBlockSize) || f.atEnd())
+                break;
+            pending.append(f.read(1 << 20));
+        }
+
+        *done = (starts.size() <= this->readBlockSize);
+        int end = pending.size();
+        if (!*done) {
+            end = starts.takeLast();
+        } else if (!starts.isEmpty()) {
+            // Drop the closing root element
+            const int rootEnd = pending.lastIndexOf("</biometric-signature-set");
+            if (rootEnd > starts.last())
+                end = rootEnd;
         }
-        *done = true;
 
+        // Split the signatures into ranges to parse in parallel
+        const int tasks = std::min(starts.size(), (starts.size() < 256) ? 1 : std::max(1, Globals->parallelism) * 4);
+        QList<Fragment> fragments;
+        for (int i=0; i<tasks; i++) {
+            const int begin = starts[starts.size() * i / tasks];
+            const int stop = (i+1 < tasks) ? starts[starts.size() * (i+1) / tasks] : end;
+            Fragment fragment;
+            fragment.bytes = pending.mid(begin, stop - begin);
+            fragment.progress = pendingOffset + stop;
+            fragment.ignoreMetadata = ignoreMetadata;
+            fragment.skipMissing = skipMissing;
+            fragments.append(fragment);
+        }
+
+        pending = *done ? QByteArray() : pending.mid(end);
+        pendingOffset += end;
+
+        TemplateList templates;
+        if (tasks == 1) {
+            templates = parseFragment(fragments.first());
+        } else if (tasks > 1) {
+            foreach (const TemplateList &parsed, QtConcurrent::blockingMapped< QList<TemplateList> >(fragments, parseFragment))
+                templates.append(parsed);
+        }
         return templates;
     }
 
@@ -181,6 +221,8 @@ class xmlGallery : public FileGallery
 
     void init()
     {
+        pending.clear();
+        pendingOffset = 0;
         FileGallery::init();
     }
 };
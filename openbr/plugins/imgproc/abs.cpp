@@ -32,6 +32,11 @@ class AbsTransform : public UntrainableTransform
     {
         dst = cv::abs(src);
     }
+
+    int tileRadius() const
+    {
+        return 0;
+    }
 };
 
 BR_REGISTER(Transform, AbsTransform)
@@ -50,6 +50,12 @@ class BlurTransform : public UntrainableTransform
             }
         }
     }
+
+    int tileRadius() const
+    {
+        // The largest kernel OpenCV derives from sigma, which it does for floating point images
+        return ROI ? -1 : (cvRound(sigma*4*2 + 1) | 1) / 2;
+    }
 };
 
 BR_REGISTER(Transform, BlurTransform)
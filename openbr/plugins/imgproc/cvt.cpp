@@ -62,6 +62,11 @@ private:
             dst = mv[channel % (int)mv.size()];
         }
     }
+
+    int tileRadius() const
+    {
+        return 0;
+    }
 };
 
 BR_REGISTER(Transform, CvtTransform)
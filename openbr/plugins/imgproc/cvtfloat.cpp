@@ -34,6 +34,11 @@ class CvtFloatTransform : public UntrainableTransform
     {
         src.m().convertTo(dst, CV_32F);
     }
+
+    int tileRadius() const
+    {
+        return 0;
+    }
 };
 
 BR_REGISTER(Transform, CvtFloatTransform)
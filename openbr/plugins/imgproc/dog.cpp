@@ -61,6 +61,11 @@ class DoGTransform : public UntrainableTransform
         GaussianBlur(src, g1, ksize1, 0);
         subtract(g0, g1, dst);
     }
+
+    int tileRadius() const
+    {
+        return std::max(ksize0.height, ksize1.height) / 2;
+    }
 };
 
 BR_REGISTER(Transform, DoGTransform)
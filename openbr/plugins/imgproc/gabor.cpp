@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -23,9 +26,97 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief A bank of complex Gabor kernels applied in the frequency domain.
+ *
+ * One forward DFT of the (reflect padded) image is shared by every kernel, and each kernel costs one spectrum multiply
+ * and one complex inverse DFT that yields its real and imaginary responses together. Kernel spectra depend on the padded
+ * image size, so they are computed the first time a size is seen and reused afterwards.
+ */
+class GaborBank
+{
+    QList<Mat> kReals, kImaginaries;
+    int padRows, padCols;
+
+    mutable QMutex spectraLock;
+    mutable QMap< QPair<int,int>, QList<Mat> > spectra;
+
+    QList<Mat> spectraFor(const Size &size) const
+    {
+        QMutexLocker locker(&spectraLock);
+        const QPair<int,int> key(size.height, size.width);
+        if (spectra.contains(key))
+            return spectra[key];
+
+        QList<Mat> kernelSpectra;
+        for (int k=0; k<kReals.size(); k++) {
+            // Flip the kernel about its center and wrap it around the origin, so the product computes correlation like filter2D
+            const Mat &kReal = kReals[k], &kImaginary = kImaginaries[k];
+            Mat kernel = Mat::zeros(size, CV_32FC2);
+            for (int y=0; y<kReal.rows; y++)
+                for (int x=0; x<kReal.cols; x++) {
+                    const int row = (size.height - (y - kReal.rows/2)) % size.height;
+                    const int col = (size.width - (x - kReal.cols/2)) % size.width;
+                    kernel.at<Vec2f>(row, col) = Vec2f(kReal.at<float>(y, x), kImaginary.at<float>(y, x));
+                }
+            Mat spectrum;
+            dft(kernel, spectrum);
+            kernelSpectra.append(spectrum);
+        }
+
+        spectra.insert(key, kernelSpectra);
+        return kernelSpectra;
+    }
+
+public:
+    GaborBank() : padRows(0), padCols(0) {}
+
+    void setKernels(const QList<Mat> &kReals, const QList<Mat> &kImaginaries)
+    {
+        QMutexLocker locker(&spectraLock);
+        this->kReals = kReals;
+        this->kImaginaries = kImaginaries;
+        padRows = padCols = 0;
+        foreach (const Mat &kReal, kReals) {
+            padRows = std::max(padRows, kReal.rows/2);
+            padCols = std::max(padCols, kReal.cols/2);
+        }
+        spectra.clear();
+    }
+
+    int size() const { return kReals.size(); }
+
+    // Complex (CV_32FC2) responses of every kernel at every pixel of src
+    QList<Mat> responses(const Mat &src) const
+    {
+        Mat image, padded;
+        src.convertTo(image, CV_32F);
+        copyMakeBorder(image, padded, padRows, padRows, padCols, padCols, BORDER_REFLECT_101);
+
+        const Size dftSize(getOptimalDFTSize(padded.cols), getOptimalDFTSize(padded.rows));
+        Mat real = Mat::zeros(dftSize, CV_32FC1);
+        padded.copyTo(real(Rect(0, 0, padded.cols, padded.rows)));
+        Mat planes[] = {real, Mat::zeros(dftSize, CV_32FC1)};
+        Mat complexImage, imageSpectrum;
+        merge(planes, 2, complexImage);
+        dft(complexImage, imageSpectrum);
+
+        QList<Mat> results;
+        foreach (const Mat &kernelSpectrum, spectraFor(dftSize)) {
+            Mat product, response;
+            mulSpectrums(imageSpectrum, kernelSpectrum, product, 0);
+            dft(product, response, DFT_INVERSE | DFT_SCALE);
+            results.append(response(Rect(padCols, padRows, src.cols, src.rows)));
+        }
+        return results;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Implements a Gabor Filter
+ *
+ * Set frequencyDomain to compute the real and imaginary responses with a single forward and inverse DFT.
  * \br_link http://en.wikipedia.org/wiki/Gabor_filter
  * \author Josh Klontz \cite jklontz
  */
@@ -39,6 +130,7 @@ class GaborTransform : public UntrainableTransform
     Q_PROPERTY(float sigma READ get_sigma WRITE set_sigma RESET reset_sigma STORED false)
     Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
     Q_PROPERTY(Component component READ get_component WRITE set_component RESET reset_component STORED false)
+    Q_PROPERTY(bool frequencyDomain READ get_frequencyDomain WRITE set_frequencyDomain RESET reset_frequencyDomain STORED false)
 
 public:
     /*!< */
@@ -54,8 +146,10 @@ private:
     BR_PROPERTY(float, sigma, 0)
     BR_PROPERTY(float, gamma, 0)
     BR_PROPERTY(Component, component, Phase)
+    BR_PROPERTY(bool, frequencyDomain, false)
 
     Mat kReal, kImaginary;
+    GaborBank bank;
 
     friend class GaborJetTransform;
 
@@ -95,15 +189,24 @@ private:
     void init()
     {
         makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+        if (frequencyDomain)
+            bank.setKernels(QList<Mat>() << kReal, QList<Mat>() << kImaginary);
     }
 
     void project(const Template &src, Template &dst) const
     {
         Mat real, imaginary, magnitude, phase;
-        if (component != Imaginary)
-            filter2D(src, real, -1, kReal);
-        if (component != Real)
-            filter2D(src, imaginary, -1, kImaginary);
+        if (frequencyDomain) {
+            std::vector<Mat> parts;
+            split(bank.responses(src).first(), parts);
+            real = parts[0];
+            imaginary = parts[1];
+        } else {
+            if (component != Imaginary)
+                filter2D(src, real, -1, kReal);
+            if (component != Real)
+                filter2D(src, imaginary, -1, kImaginary);
+        }
         if ((component == Magnitude) || (component == Phase))
             cartToPolar(real, imaginary, magnitude, phase);
 
@@ -120,6 +223,10 @@ BR_REGISTER(Transform, GaborTransform)
 /*!
  * \ingroup transforms
  * \brief A vector of gabor wavelets applied at a point.
+ *
+ * By default each wavelet is evaluated directly on the window around each point. Set frequencyDomain to share one
+ * forward DFT between all wavelets instead, which is cheaper for many points and large wavelets. Responses then use
+ * reflected borders like GaborTransform, rather than shifting windows inside the image.
  * \author Josh Klontz \cite jklontz
  */
 class GaborJetTransform : public UntrainableTransform
@@ -132,14 +239,17 @@ class GaborJetTransform : public UntrainableTransform
     Q_PROPERTY(QList<float> sigmas READ get_sigmas WRITE set_sigmas RESET reset_sigmas STORED false)
     Q_PROPERTY(QList<float> gammas READ get_gammas WRITE set_gammas RESET reset_gammas STORED false)
     Q_PROPERTY(br::GaborTransform::Component component READ get_component WRITE set_component RESET reset_component STORED false)
+    Q_PROPERTY(bool frequencyDomain READ get_frequencyDomain WRITE set_frequencyDomain RESET reset_frequencyDomain STORED false)
     BR_PROPERTY(QList<float>, lambdas, QList<float>())
     BR_PROPERTY(QList<float>, thetas, QList<float>())
     BR_PROPERTY(QList<float>, psis, QList<float>())
     BR_PROPERTY(QList<float>, sigmas, QList<float>())
     BR_PROPERTY(QList<float>, gammas, QList<float>())
     BR_PROPERTY(GaborTransform::Component, component, GaborTransform::Phase)
+    BR_PROPERTY(bool, frequencyDomain, false)
 
     QList<Mat> kReals, kImaginaries;
+    GaborBank bank;
 
     void init()
     {
@@ -155,8 +265,21 @@ class GaborJetTransform : public UntrainableTransform
                             kReals.append(kReal);
                             kImaginaries.append(kImaginary);
                         }
+        if (frequencyDomain)
+            bank.setKernels(kReals, kImaginaries);
     }
 
+    static float select(float real, float imaginary, GaborTransform::Component component)
+    {
+        if      (component == GaborTransform::Real)      return real;
+        else if (component == GaborTransform::Imaginary) return imaginary;
+        else if (component == GaborTransform::Magnitude) return sqrt(real*real + imaginary*imaginary);
+        else if (component == GaborTransform::Phase)     return atan2(imaginary, real)*180/CV_PI;
+        qFatal("Invalid component.");
+        return 0;
+    }
+
+    // Real and imaginary parts are accumulated together in one pass over the window
     static float response(const cv::Mat &src, const QPointF &point, const Mat &kReal, const Mat &kImaginary, GaborTransform::Component component)
     {
         Rect roi(std::max(std::min((int)(point.x() - kReal.cols/2.f), src.cols - kReal.cols), 0),
@@ -164,38 +287,42 @@ class GaborJetTransform : public UntrainableTransform
                  kReal.cols,
                  kReal.rows);
 
-        float real = 0, imaginary = 0, magnitude = 0, phase = 0;
-        if (component != GaborTransform::Imaginary) {
-            Mat dst;
-            multiply(src(roi), kReal, dst);
-            real = sum(dst)[0];
-        }
-        if (component != GaborTransform::Real) {
-            Mat dst;
-            multiply(src(roi), kImaginary, dst);
-            imaginary = sum(dst)[0];
-        }
-        if ((component == GaborTransform::Magnitude) || (component == GaborTransform::Phase)) {
-            magnitude = sqrt(real*real + imaginary*imaginary);
-            phase = atan2(imaginary, real)*180/CV_PI;
+        float real = 0, imaginary = 0;
+        for (int y=0; y<roi.height; y++) {
+            const float *s = src.ptr<float>(roi.y + y) + roi.x;
+            const float *r = kReal.ptr<float>(y);
+            const float *i = kImaginary.ptr<float>(y);
+            for (int x=0; x<roi.width; x++) {
+                real += s[x] * r[x];
+                imaginary += s[x] * i[x];
+            }
         }
 
-        float dst = 0;
-        if      (component == GaborTransform::Real)      dst = real;
-        else if (component == GaborTransform::Imaginary) dst = imaginary;
-        else if (component == GaborTransform::Magnitude) dst = magnitude;
-        else if (component == GaborTransform::Phase)     dst = phase;
-        else                                             qFatal("Invalid component.");
-        return dst;
+        return select(real, imaginary, component);
     }
 
     void project(const Template &src, Template &dst) const
     {
         const QList<QPointF> points = src.file.points();
         dst = Mat(points.size(), kReals.size(), CV_32FC1);
+
+        if (frequencyDomain) {
+            const QList<Mat> responses = bank.responses(src);
+            for (int j=0; j<responses.size(); j++)
+                for (int i=0; i<points.size(); i++) {
+                    const int row = std::max(0, std::min(src.m().rows-1, (int)points[i].y()));
+                    const int col = std::max(0, std::min(src.m().cols-1, (int)points[i].x()));
+                    const Vec2f &value = responses[j].at<Vec2f>(row, col);
+                    dst.m().at<float>(i,j) = select(value[0], value[1], component);
+                }
+            return;
+        }
+
+        Mat image;
+        src.m().convertTo(image, CV_32F);
         for (int i=0; i<points.size(); i++)
             for (int j=0; j<kReals.size(); j++)
-                    dst.m().at<float>(i,j) = response(src, points[i], kReals[j], kImaginaries[j], component);
+                    dst.m().at<float>(i,j) = response(image, points[i], kReals[j], kImaginaries[j], component);
     }
 };
 
@@ -46,6 +46,11 @@ class GammaTransform : public UntrainableTransform
         if (src.m().depth() == CV_8U) LUT(src, lut, dst);
         else                          pow(src, gamma, dst);
     }
+
+    int tileRadius() const
+    {
+        return 0;
+    }
 };
 
 BR_REGISTER(Transform, GammaTransform)
@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -61,6 +62,52 @@ private:
 
 BR_REGISTER(Transform, GradientTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Histograms of gradient orientation over a grid of rectangular regions.
+ *
+ * Equivalent to Gradient+RectRegions(width,height,widthStep,heightStep)+HistBin(0,360,bins)+Hist(bins),
+ * but the orientation image is quantized once and accumulated straight into the overlapping region histograms
+ * without per-region matrices.
+ * \br_related_plugin GradientTransform RectRegionsTransform HistBinTransform HistTransform
+ */
+class GradientHistTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+    BR_PROPERTY(int, bins, 8)
+
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.m().channels() != 1)
+            qFatal("Expected single channel input.");
+        if ((bins < 1) || (bins > 256))
+            qFatal("Invalid bin count: %d", bins);
+
+        Mat dx, dy, magnitude, angle, codes;
+        Sobel(src, dx, CV_32F, 1, 0, CV_SCHARR);
+        Sobel(src, dy, CV_32F, 0, 1, CV_SCHARR);
+        cartToPolar(dx, dy, magnitude, angle, true);
+
+        // Same rounding as HistBin on floating point input
+        angle.convertTo(codes, CV_8U, bins/360.0, -0.5);
+
+        const Size step(widthStep == -1 ? width : widthStep, heightStep == -1 ? height : heightStep);
+        foreach (const Mat &hist, OpenCVUtils::regionHistograms(codes, bins, Size(width, height), step))
+            dst += hist;
+    }
+};
+
+BR_REGISTER(Transform, GradientHistTransform)
+
 } // namespace br
 
 #include "imgproc/gradient.moc"
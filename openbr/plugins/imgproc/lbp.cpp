@@ -18,9 +18,9 @@
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/highgui/highgui_c.h>
-#include <limits>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/lbputils.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -48,82 +48,64 @@ class LBPTransform : public UntrainableTransform
     uchar lut[256];
     uchar null;
 
-    /* Returns the number of 0->1 or 1->0 transitions in i */
-    static int numTransitions(int i)
+    void init()
     {
-        int transitions = 0;
-        int curParity = i%2;
-        for (int j=1; j<=8; j++) {
-            int parity = (i>>(j%8)) % 2;
-            if (parity != curParity) transitions++;
-            curParity = parity;
-        }
-        return transitions;
+        null = LBPUtils::makeLUT(lut, maxTransitions, rotationInvariant);
     }
 
-    static int rotationInvariantEquivalent(int i)
+    void project(const Template &src, Template &dst) const
     {
-        int min = std::numeric_limits<int>::max();
-        for (int j=0; j<8; j++) {
-            bool parity = i % 2;
-            i = i >> 1;
-            if (parity) i+=128;
-            min = std::min(min, i);
-        }
-        return min;
+        dst += LBPUtils::codes(src, radius, lut, null);
     }
+};
+
+BR_REGISTER(Transform, LBPTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Local Binary Pattern histograms over a grid of rectangular regions, for one or more radii.
+ *
+ * Equivalent to LBP(radius,maxTransitions,rotationInvariant)+RectRegions(width,height,widthStep,heightStep)+Hist(bins)
+ * for each radius in turn, where bins is the number of pattern ids. The histograms of all regions are accumulated from
+ * the pattern ids by sliding per-column histograms down and across the image, rather than counting each region separately.
+ * \br_related_plugin LBPTransform RectRegionsTransform HistTransform
+ */
+class LBPHistTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QList<int> radii READ get_radii WRITE set_radii RESET reset_radii STORED false)
+    Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
+    Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    BR_PROPERTY(QList<int>, radii, QList<int>() << 1)
+    BR_PROPERTY(int, maxTransitions, 8)
+    BR_PROPERTY(bool, rotationInvariant, false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+
+    uchar lut[256];
+    uchar null;
 
     void init()
     {
-        bool set[256];
-        uchar uid = 0;
-        for (int i=0; i<256; i++) {
-            if (numTransitions(i) <= maxTransitions) {
-                int id;
-                if (rotationInvariant) {
-                    int rie = rotationInvariantEquivalent(i);
-                    if (i == rie) id = uid++;
-                    else          id = lut[rie];
-                } else            id = uid++;
-                lut[i] = id;
-                set[i] = true;
-            } else {
-                set[i] = false;
-            }
-        }
-
-        null = uid;
-        for (int i=0; i<256; i++)
-            if (!set[i])
-                lut[i] = null; // Set to null id
+        null = LBPUtils::makeLUT(lut, maxTransitions, rotationInvariant);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
-        Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
-            }
-        }
-
-        dst += n;
+        const Size step(widthStep == -1 ? width : widthStep, heightStep == -1 ? height : heightStep);
+        foreach (int radius, radii)
+            foreach (const Mat &hist, OpenCVUtils::regionHistograms(LBPUtils::codes(src, radius, lut, null), null+1, Size(width, height), step))
+                dst += hist;
     }
 };
 
-BR_REGISTER(Transform, LBPTransform)
+BR_REGISTER(Transform, LBPHistTransform)
 
 } // namespace br
 
@@ -39,6 +39,11 @@ class PowTransform : public UntrainableTransform
         pow(preserveSign ? abs(src) : src.m(), power, dst);
         if (preserveSign) subtract(Scalar::all(0), dst, dst, src.m() < 0);
     }
+
+    int tileRadius() const
+    {
+        return 0;
+    }
 };
 
 BR_REGISTER(Transform, PowTransform)
@@ -14,7 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QPointer>
 #include <QtConcurrent>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
@@ -26,10 +30,21 @@ namespace br
 {
 
 QVector<Mat> ProductQuantizationLUTs;
+QVector< QList<Mat> > ProductQuantizationCenters;
+QVector< QPointer<Distance> > ProductQuantizationDistances; // Cleared when the owning transform is destroyed
 
 /*!
  * \ingroup distances
  * \brief Distance in a product quantized space
+ *
+ * Targets are scanned in batches against a per-query table of distances to every codeword,
+ * so the triangular LUT is only consulted once per query rather than once per comparison.
+ * Configure with BR_WITH_AVX2 to gather the table entries of eight targets at a time.
+ * If a query template holds the raw (unquantized, floating point) vector instead of codes,
+ * it is scored asymmetrically using the transform's distance from its sub-vectors to the codebook centers,
+ * the same distance the LUT was built from, so asymmetric and symmetric scores are comparable.
+ * Raw queries aren't supported with bayesian LUTs, whose log-likelihoods are only known between pairs of codewords.
+ *
  * \br_paper Jegou, Herve, Matthijs Douze, and Cordelia Schmid.
  *           "Product quantization for nearest neighbor search."
  *           Pattern Analysis and Machine Intelligence, IEEE Transactions on 33.1 (2011): 117-128
@@ -41,8 +56,152 @@ class ProductQuantizationDistance : public UntrainableDistance
     Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
     BR_PROPERTY(bool, bayesian, false)
 
+    static inline bool isRaw(const Mat &m)
+    {
+        return m.depth() != CV_8U;
+    }
+
+    static inline quint16 codebook(const Mat &m)
+    {
+        return *reinterpret_cast<const quint16*>(m.data);
+    }
+
+    static inline const uchar *codes(const Mat &m)
+    {
+        return m.data + sizeof(quint16);
+    }
+
+    // Row j holds the distance from the query's j-th subspace to each of the 256 codewords
+    Mat queryTable(const Mat &query, quint16 index) const
+    {
+        if (isRaw(query)) {
+            const QList<Mat> &centers = ProductQuantizationCenters[index];
+            const Distance *distance = ProductQuantizationDistances[index];
+            // Bayesian LUTs are log-likelihoods between pairs of codewords, which have no counterpart for a raw vector
+            if (centers.isEmpty() || !distance || bayesian)
+                qFatal("Asymmetric comparison requires a trained, non-bayesian codebook.");
+
+            Mat vector;
+            query.reshape(1, 1).convertTo(vector, CV_32F);
+            Mat table(centers.size(), 256, CV_32FC1);
+            int start = 0;
+            for (int j=0; j<centers.size(); j++) {
+                const Mat subvector = vector.colRange(start, start + centers[j].cols);
+                start += centers[j].cols;
+                float *row = table.ptr<float>(j);
+                for (int c=0; c<256; c++)
+                    row[c] = distance->compare(subvector, centers[j].row(c));
+            }
+            return table;
+        }
+
+        const Mat &lut = ProductQuantizationLUTs[index];
+        const uchar *queryCodes = codes(query);
+        Mat table(lut.rows, 256, CV_32FC1);
+        for (int j=0; j<lut.rows; j++) {
+            const float *lutRow = lut.ptr<float>(j);
+            float *row = table.ptr<float>(j);
+            const int q = queryCodes[j];
+            // http://stackoverflow.com/questions/4803180/mapping-elements-in-2d-upper-triangle-and-lower-triangle-to-linear-structure
+            for (int c=0; c<q; c++)
+                row[c] = lutRow[c + (q+1)*q/2];
+            for (int c=q; c<256; c++)
+                row[c] = lutRow[q + (c+1)*c/2];
+        }
+        return table;
+    }
+
+    // Sums table[j][codes[t][j]] over the subspaces for count targets at once
+    static void scan(const float *table, const uchar *const *targetCodes, int count, int dims, float *distances)
+    {
+        int t = 0;
+#ifdef __AVX2__
+        for (; t+8<=count; t+=8) {
+            __m256 accumulate = _mm256_setzero_ps();
+            for (int j=0; j<dims; j++) {
+                const __m256i offsets = _mm256_setr_epi32(targetCodes[t][j],   targetCodes[t+1][j], targetCodes[t+2][j], targetCodes[t+3][j],
+                                                          targetCodes[t+4][j], targetCodes[t+5][j], targetCodes[t+6][j], targetCodes[t+7][j]);
+                accumulate = _mm256_add_ps(accumulate, _mm256_i32gather_ps(table + j*256, offsets, sizeof(float)));
+            }
+            _mm256_storeu_ps(distances + t, accumulate);
+        }
+#endif
+        // Interleave targets so the table loads are independent of each other
+        for (; t+4<=count; t+=4) {
+            const uchar *a = targetCodes[t], *b = targetCodes[t+1], *c = targetCodes[t+2], *d = targetCodes[t+3];
+            float da = 0, db = 0, dc = 0, dd = 0;
+            for (int j=0; j<dims; j++) {
+                const float *row = table + j*256;
+                da += row[a[j]];
+                db += row[b[j]];
+                dc += row[c[j]];
+                dd += row[d[j]];
+            }
+            distances[t] = da; distances[t+1] = db; distances[t+2] = dc; distances[t+3] = dd;
+        }
+        for (; t<count; t++) {
+            float distance = 0;
+            for (int j=0; j<dims; j++)
+                distance += table[j*256 + targetCodes[t][j]];
+            distances[t] = distance;
+        }
+    }
+
+    void scanTargets(const TemplateList &targets, const Template &query, float *scores) const
+    {
+        QVector<int> valid; valid.reserve(targets.size());
+        for (int t=0; t<targets.size(); t++) {
+            if (targets[t].isEmpty() || query.isEmpty()) {
+                scores[t] = -std::numeric_limits<float>::max();
+            } else {
+                scores[t] = 0;
+                valid.append(t);
+            }
+        }
+        if (valid.isEmpty())
+            return;
+
+        QVector<const uchar*> targetCodes(valid.size());
+        QVector<float> distances(valid.size());
+        for (int i=0; i<query.size(); i++) {
+            const Mat table = queryTable(query[i], codebook(targets[valid.first()][i]));
+            for (int k=0; k<valid.size(); k++)
+                targetCodes[k] = codes(targets[valid[k]][i]);
+            scan(table.ptr<float>(), targetCodes.data(), valid.size(), table.rows, distances.data());
+            for (int k=0; k<valid.size(); k++)
+                scores[valid[k]] += distances[k];
+        }
+
+        if (!bayesian)
+            foreach (int t, valid)
+                scores[t] = -log(scores[t]+1);
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        QVector<float> scores(target.size());
+        for (int i=0; i<query.size(); i++) {
+            scanTargets(target, query[i], scores.data());
+            for (int j=0; j<target.size(); j++)
+                output->setRelative(scores[j], i+queryOffset, j+targetOffset);
+        }
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores(targets.size());
+        scanTargets(targets, query, scores.data());
+        return scores.toList();
+    }
+
     float compare(const Template &a, const Template &b) const
     {
+        // Raw vectors are scored asymmetrically against the other template's codes
+        if (!a.isEmpty() && isRaw(a.first()))
+            return compare(TemplateList() << b, a).first();
+        if (!b.isEmpty() && isRaw(b.first()))
+            return compare(TemplateList() << a, b).first();
+
         float distance = 0;
         for (int i=0; i<a.size(); i++) {
             const int elements = a[i].total()-sizeof(quint16);
@@ -103,6 +262,8 @@ public:
         QMutexLocker locker(&mutex);
         index = ProductQuantizationLUTs.size();
         ProductQuantizationLUTs.append(Mat());
+        ProductQuantizationCenters.append(QList<Mat>());
+        ProductQuantizationDistances.append(NULL);
     }
 
 private:
@@ -236,6 +397,8 @@ private:
             else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i]);
         }
         futures.waitForFinished();
+        ProductQuantizationCenters[index] = centers;
+        ProductQuantizationDistances[index] = bayesian ? NULL : distance;
     }
 
     int getIndex(const Mat &m, const Mat &center) const
@@ -275,6 +438,12 @@ private:
         while (ProductQuantizationLUTs.size() <= index)
             ProductQuantizationLUTs.append(Mat());
         stream >> ProductQuantizationLUTs[index];
+        while (ProductQuantizationCenters.size() <= index)
+            ProductQuantizationCenters.append(QList<Mat>());
+        ProductQuantizationCenters[index] = centers;
+        while (ProductQuantizationDistances.size() <= index)
+            ProductQuantizationDistances.append(NULL);
+        ProductQuantizationDistances[index] = bayesian ? NULL : distance;
     }
 };
 
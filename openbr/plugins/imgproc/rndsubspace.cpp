@@ -40,6 +40,12 @@ class RndSubspaceTransform : public MetaTransform
 
     QList<Mat> maps;
 
+    int trainingSamples() const
+    {
+        // Only the template dimensions are needed unless dimensions are weighted by their variance
+        return weighted ? 0 : 1;
+    }
+
     void train(const TemplateList &data)
     {
         // While RndSubspace transform could be independent, making it a MetaTransform is a workaround
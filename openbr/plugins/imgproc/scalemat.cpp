@@ -28,6 +28,11 @@ class ScaleMatTransform : public UntrainableTransform
     {
         dst = src * scaleFactor;
     }
+
+    int tileRadius() const
+    {
+        return 0;
+    }
 };
 
 BR_REGISTER(Transform, ScaleMatTransform)
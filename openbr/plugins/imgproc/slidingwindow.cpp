@@ -14,8 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/pyramid.h>
 #include <openbr/core/qtutils.h>
 
 #include <opencv2/imgproc/imgproc.hpp>
@@ -41,6 +43,8 @@ namespace br
  * \br_property bool group If false, non-maxima supression will not be performed
  * \br_property int shrinkingFactor Step value for sliding window
  * \br_property bool clone If false, window will not be cloned (i.e. the representation used by the classifier does not need continuous matrix data)
+ * \br_property bool sharedPyramid If true, scaled and preprocessed images are kept in a process-wide cache keyed by image and scale, so detectors run over the same image (face, eyes, profile) build each pyramid level once. Detectors whose classifiers preprocess identically also share the preprocessed levels (e.g. integral images).
+ * \br_property bool parallelScales If true, the scales of a single image are searched concurrently.
  */
 class SlidingWindowTransform : public MetaTransform
 {
@@ -60,6 +64,8 @@ class SlidingWindowTransform : public MetaTransform
     Q_PROPERTY(float minConfidence READ get_minConfidence WRITE set_minConfidence RESET reset_minConfidence STORED false)
     Q_PROPERTY(bool ROCMode READ get_ROCMode WRITE set_ROCMode RESET reset_ROCMode STORED false)
     Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
+    Q_PROPERTY(bool sharedPyramid READ get_sharedPyramid WRITE set_sharedPyramid RESET reset_sharedPyramid STORED false)
+    Q_PROPERTY(bool parallelScales READ get_parallelScales WRITE set_parallelScales RESET reset_parallelScales STORED false)
     BR_PROPERTY(br::Classifier*, classifier, NULL)
     BR_PROPERTY(int, minSize, 20)
     BR_PROPERTY(int, maxSize, -1)
@@ -73,10 +79,24 @@ class SlidingWindowTransform : public MetaTransform
     BR_PROPERTY(float, minConfidence, 0)
     BR_PROPERTY(bool, ROCMode, false)
     BR_PROPERTY(QString, outputVariable, "Face")
+    BR_PROPERTY(bool, sharedPyramid, false)
+    BR_PROPERTY(bool, parallelScales, false)
+
+    // One scale of the search, independent of every other scale
+    struct Level
+    {
+        double factor;
+        QList<Rect> rects;
+        QList<float> confidences;
+    };
+
+    mutable QByteArray fingerprint;
+    mutable QMutex fingerprintLock;
 
     void train(const TemplateList &data)
     {
         classifier->train(data);
+        fingerprint.clear();
     }
 
     void project(const Template &src, Template &dst) const
@@ -114,60 +134,34 @@ class SlidingWindowTransform : public MetaTransform
             const int maxDetections = t.file.get<int>("MaxDetections", std::numeric_limits<int>::max());
             const bool findMostConfident = (enrollAll && (maxDetections != 1)) ? false : true;
 
-            QList<Rect> rects;
-            QList<float> confidences;
-
-            int dx, dy;
-            const Size classifierSize = classifier->windowSize(&dx, &dy);
-
+            QList<Level> levels;
             for (double factor = 1; ; factor *= scaleFactor) {
                 // TODO: This should support non-square sizes
-                // Compute the size of the window in which we will detect faces
-                const Size detectionSize(cvRound(minSize*factor),cvRound(minSize*factor));
-
                 // Stop if detection size is bigger than the image itself
-                if (detectionSize.width > imageSize.width || detectionSize.height > imageSize.height)
+                const int detectionSize = cvRound(minSize*factor);
+                if (detectionSize > imageSize.width || detectionSize > imageSize.height)
                     break;
 
-                const float widthScale = (float)classifierSize.width/detectionSize.width;
-                const float heightScale = (float)classifierSize.height/detectionSize.height;
+                Level level;
+                level.factor = factor;
+                levels.append(level);
+            }
 
-                // Scale the image such that the detection size within the image corresponds to the respresentation size
-                const Size scaledImageSize(cvRound(imageSize.width*widthScale), cvRound(imageSize.height*heightScale));
+            if (parallelScales && (levels.size() > 1)) {
+                QFutureSynchronizer<void> futures;
+                for (int i=0; i<levels.size(); i++)
+                    futures.addFuture(QtConcurrent::run(this, &SlidingWindowTransform::detect, t, minSize, &levels[i]));
+                futures.waitForFinished();
+            } else {
+                for (int i=0; i<levels.size(); i++)
+                    detect(t, minSize, &levels[i]);
+            }
 
-                Template rep(t.file);
-                foreach (const Mat &m, t) {
-                    Mat scaledImage;
-                    resize(m, scaledImage, scaledImageSize, 0, 0, CV_INTER_AREA);
-                    rep.append(scaledImage);
-                }
-                rep = classifier->preprocess(rep);
-		
-                // Pre-allocate the window to avoid constructing this every iteration
-                Template window(t.file);
-                for (int i=0; i<rep.size(); i++)
-                    window.append(Mat());
-
-                const int step = factor > 2.0 ? shrinkingFactor : shrinkingFactor*2;
-                for (int y = 0; y < scaledImageSize.height-classifierSize.height; y += step) {
-                    for (int x = 0; x < scaledImageSize.width-classifierSize.width; x += step) {
-                        for (int i=0; i<rep.size(); i++) {
-                            if (clone)
-                                window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy))).clone();
-                            else
-                                window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy)));
-                        }
-
-                        float confidence = 0;
-                        int result = classifier->classify(window, false, &confidence);
-
-                        if (result == 1) {
-                            rects.append(Rect(cvRound(x/widthScale), cvRound(y/heightScale), detectionSize.width, detectionSize.height));
-                            confidences.append(confidence);
-                        } else
-                            x += step;
-                    }
-                }
+            QList<Rect> rects;
+            QList<float> confidences;
+            foreach (const Level &level, levels) {
+                rects.append(level.rects);
+                confidences.append(level.confidences);
             }
 
             if (group)
@@ -213,9 +207,75 @@ class SlidingWindowTransform : public MetaTransform
         }
     }
 
+    void detect(const Template &t, int minSize, Level *level) const
+    {
+        const Size imageSize = t.m().size();
+
+        int dx, dy;
+        const Size classifierSize = classifier->windowSize(&dx, &dy);
+
+        // Compute the size of the window in which we will detect faces
+        const Size detectionSize(cvRound(minSize*level->factor),cvRound(minSize*level->factor));
+
+        const float widthScale = (float)classifierSize.width/detectionSize.width;
+        const float heightScale = (float)classifierSize.height/detectionSize.height;
+
+        // Scale the image such that the detection size within the image corresponds to the respresentation size
+        const Size scaledImageSize(cvRound(imageSize.width*widthScale), cvRound(imageSize.height*heightScale));
+
+        Template rep;
+        if (sharedPyramid) {
+            rep = FeaturePyramid::preprocessed(t, scaledImageSize, classifier, classifierFingerprint());
+        } else {
+            rep = Template(t.file);
+            foreach (const Mat &m, t) {
+                Mat scaledImage;
+                resize(m, scaledImage, scaledImageSize, 0, 0, CV_INTER_AREA);
+                rep.append(scaledImage);
+            }
+            rep = classifier->preprocess(rep);
+        }
+
+        // Pre-allocate the window to avoid constructing this every iteration
+        Template window(t.file);
+        for (int i=0; i<rep.size(); i++)
+            window.append(Mat());
+
+        const int step = level->factor > 2.0 ? shrinkingFactor : shrinkingFactor*2;
+        for (int y = 0; y < scaledImageSize.height-classifierSize.height; y += step) {
+            for (int x = 0; x < scaledImageSize.width-classifierSize.width; x += step) {
+                for (int i=0; i<rep.size(); i++) {
+                    if (clone)
+                        window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy))).clone();
+                    else
+                        window[i] = rep[i](Rect(Point(x, y), Size(classifierSize.width+dx, classifierSize.height+dy)));
+                }
+
+                float confidence = 0;
+                int result = classifier->classify(window, false, &confidence);
+
+                if (result == 1) {
+                    level->rects.append(Rect(cvRound(x/widthScale), cvRound(y/heightScale), detectionSize.width, detectionSize.height));
+                    level->confidences.append(confidence);
+                } else
+                    x += step;
+            }
+        }
+    }
+
+    QByteArray classifierFingerprint() const
+    {
+        // Computed on first use, once the classifier has been trained or loaded
+        QMutexLocker locker(&fingerprintLock);
+        if (fingerprint.isEmpty())
+            fingerprint = FeaturePyramid::fingerprint(classifier);
+        return fingerprint;
+    }
+
     void load(QDataStream &stream)
     {
         classifier->load(stream);
+        fingerprint.clear();
     }
 
     void store(QDataStream &stream) const
@@ -0,0 +1,90 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QMutex>
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Writes each template's score vector straight into its row of a preallocated .mtx file, or its column in transpose mode.
+ *
+ * The row (or column) is the template's FrameNumber, i.e. its position in the compared gallery. Several processes can
+ * write disjoint rows of the same matrix concurrently, so the output of a multi-process comparison doesn't need to be
+ * serialized through a single Output stage. Scores are removed from the templates once written.
+ *
+ * \br_property QString matrix The .mtx file to write into, it must already have the full size.
+ * \br_property bool transposeMode Whether templates hold columns rather than rows of the matrix.
+ */
+class MatrixTileTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString matrix READ get_matrix WRITE set_matrix RESET reset_matrix STORED false)
+    Q_PROPERTY(bool transposeMode READ get_transposeMode WRITE set_transposeMode RESET reset_transposeMode STORED false)
+    BR_PROPERTY(QString, matrix, "")
+    BR_PROPERTY(bool, transposeMode, false)
+
+    mutable QMutex mapLock;
+    mutable QSharedPointer<QFile> file;
+    mutable cv::Mat mapped;
+
+    void init()
+    {
+        QMutexLocker locker(&mapLock);
+        mapped = cv::Mat();
+        file.clear();
+    }
+
+    // Mapped on first use so only the processes doing the comparisons map the matrix
+    cv::Mat map() const
+    {
+        QMutexLocker locker(&mapLock);
+        if (!file) {
+            file = QSharedPointer<QFile>(new QFile());
+            mapped = BEE::mapMatrix(matrix, *file, NULL, NULL, NULL, true);
+            if (mapped.type() != CV_32FC1)
+                qFatal("Expected a similarity matrix in %s.", qPrintable(matrix));
+        }
+        return mapped;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const int index = src.file.get<int>("FrameNumber");
+        const cv::Mat scores = map();
+        cv::Mat tile = transposeMode ? scores.col(index) : scores.row(index);
+
+        if (src.file.getBool("FTE") || src.file.fte || src.isEmpty()) {
+            tile.setTo(-std::numeric_limits<float>::max());
+        } else {
+            if (int(src.m().total()) != int(tile.total()))
+                qFatal("Expected %d scores but got %d.", int(tile.total()), int(src.m().total()));
+            src.m().reshape(1, tile.rows).copyTo(tile);
+        }
+
+        // Only the metadata needs to travel back to the caller
+        dst.file = src.file;
+    }
+};
+
+BR_REGISTER(Transform, MatrixTileTransform)
+
+} // namespace br
+
+#include "io/matrixtile.moc"
@@ -14,7 +14,14 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QBuffer>
+#include <QThreadStorage>
+#include <QtConcurrent>
+#ifndef BR_EMBEDDED
+#include <QImageReader>
+#endif // BR_EMBEDDED
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
 
@@ -23,16 +30,170 @@ using namespace cv;
 namespace br
 {
 
+// Format instances reused by each thread, keyed by the plugin name or suffix that selects them
+static QThreadStorage< QHash<QString, QSharedPointer<Format> > > formatCache;
+
+// Encoded image bytes, reused by each thread to avoid an allocation per file
+static QThreadStorage<QByteArray> readBuffers;
+
+static QSharedPointer<Format> cachedFormat(const File &file)
+{
+    QHash<QString, QSharedPointer<Format> > &formats = formatCache.localData();
+    const QString key = file.get<QString>("plugin", file.suffix());
+
+    QSharedPointer<Format> format = formats.value(key);
+    if (format.isNull()) {
+        format = QSharedPointer<Format>(Factory<Format>::make(file));
+        // Properties are initialized from the file a format is made for,
+        // so only formats without any can be reused for other files
+        if (format->metaObject()->propertyCount() == Format::staticMetaObject.propertyCount())
+            formats.insert(key, format);
+    } else {
+        format->file = file;
+    }
+    return format;
+}
+
+// Encoded images larger than this are left to DefaultFormat rather than buffered
+static const qint64 maxImageBytes = 256*1024*1024;
+
+// Image files read by DefaultFormat from local disk, these are decoded here instead.
+// Other files, notably videos, are left to DefaultFormat.
+static bool isLocalImage(const QSharedPointer<Format> &format, const File &file)
+{
+    static const QStringList imageSuffixes = QStringList() << "bmp" << "dib" << "jpeg" << "jpg" << "jpe" << "jp2" << "png" << "webp"
+                                                           << "pbm" << "pgm" << "ppm" << "sr" << "ras" << "tiff" << "tif";
+    return (format->objectName() == "Default") &&
+           !file.name.startsWith("http://") && !file.name.startsWith("https://") && !file.name.startsWith("www.") &&
+           imageSuffixes.contains(file.suffix().toLower());
+}
+
+static bool readBytes(const File &file, QByteArray &bytes)
+{
+    QFile f(file.resolved());
+    if (!f.open(QFile::ReadOnly))
+        return false;
+    const qint64 size = f.size();
+    if (size > maxImageBytes)
+        return false;
+    bytes.resize(static_cast<int>(size)); // Bounded by maxImageBytes, keeps the existing allocation when shrinking
+    return f.read(bytes.data(), size) == size;
+}
+
 /*!
  * \ingroup transforms
  * \brief Applies Format to Template filename and appends results.
+ *
+ * Local image files up to 256 MB are decoded in memory, using a buffer and Format instances reused by each thread.
+ * Videos and other files are read by their Format directly.
+ * When projecting a TemplateList, the files of the next block are read from disk in the background while the current block is decoded in parallel.
+ *
+ * \br_property int decodeSize If positive, JPEG images are decoded at 1/2, 1/4 or 1/8 scale in the DCT domain, as long as their longest side stays at least decodeSize pixels. Set this to the size of a following LimitSize or Resize. Default is -1, which always decodes at full resolution.
  * \author Josh Klontz \cite jklontz
  */
 class OpenTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(int decodeSize READ get_decodeSize WRITE set_decodeSize RESET reset_decodeSize STORED false)
+    BR_PROPERTY(int, decodeSize, -1)
 
-    void project(const Template &src, Template &dst) const
+    struct Job
+    {
+        const OpenTransform *transform;
+        Template src;
+        QList<QByteArray> bytes;
+    };
+
+    static Template openJob(const Job &job)
+    {
+        Template dst;
+        try {
+            job.transform->open(job.src, dst, job.bytes);
+        } catch (...) {
+            qWarning("Exception triggered when processing %s with transform %s", qPrintable(job.src.file.flat()), qPrintable(job.transform->objectName()));
+            dst = Template(job.src.file);
+            dst.file.fte = true;
+        }
+        return dst;
+    }
+
+    // Encoded bytes of each local image to be opened, run in the background
+    static QList<Job> prefetch(const OpenTransform *transform, const TemplateList &templates)
+    {
+        QList<Job> jobs;
+        foreach (const Template &t, templates) {
+            Job job;
+            job.transform = transform;
+            job.src = t;
+            if (t.empty()) {
+                foreach (const File &file, t.file.split()) {
+                    QByteArray bytes;
+                    if (isLocalImage(cachedFormat(file), file))
+                        readBytes(file, bytes);
+                    job.bytes.append(bytes);
+                }
+            }
+            jobs.append(job);
+        }
+        return jobs;
+    }
+
+    Mat decode(const QByteArray &bytes) const
+    {
+#ifndef BR_EMBEDDED
+        if (decodeSize > 0) {
+            QBuffer buffer(const_cast<QByteArray*>(&bytes));
+            buffer.open(QIODevice::ReadOnly);
+            QImageReader reader(&buffer);
+            const QSize size = reader.size();
+            if (size.isValid() && (reader.format() == "jpeg")) {
+                // libjpeg can scale by 1/2, 1/4 and 1/8 while decoding
+                const int longest = std::max(size.width(), size.height());
+                int scale = 1;
+                while ((scale < 8) && (longest / (2*scale) >= decodeSize))
+                    scale *= 2;
+
+                if (scale > 1) {
+                    reader.setScaledSize(QSize((size.width() + scale - 1) / scale, (size.height() + scale - 1) / scale));
+                    const QImage image = reader.read().convertToFormat(QImage::Format_RGB888);
+                    if (!image.isNull()) {
+                        Mat m;
+                        cvtColor(Mat(image.height(), image.width(), CV_8UC3, (void*) image.constBits(), image.bytesPerLine()), m, CV_RGB2BGR);
+                        return m;
+                    }
+                }
+            }
+        }
+#endif // BR_EMBEDDED
+
+        return imdecode(Mat(1, bytes.size(), CV_8UC1, (void*) bytes.constData()), IMREAD_COLOR);
+    }
+
+    Template read(const File &file, const QByteArray &prefetched) const
+    {
+        QSharedPointer<Format> format = cachedFormat(file);
+        if (isLocalImage(format, file)) {
+            Mat m;
+            if (!prefetched.isEmpty()) {
+                m = decode(prefetched);
+            } else {
+                QByteArray &bytes = readBuffers.localData();
+                if (readBytes(file, bytes))
+                    m = decode(bytes);
+            }
+
+            if (m.data) {
+                Template t;
+                t.append(m);
+                return t;
+            }
+        }
+
+        // Videos, URLs and other formats
+        return format->read();
+    }
+
+    void open(const Template &src, Template &dst, const QList<QByteArray> &prefetched) const
     {
         dst.file = src.file;
         if (src.empty()) {
@@ -40,9 +201,10 @@ class OpenTransform : public UntrainableMetaTransform
                 qDebug("Opening %s", qPrintable(src.file.flat()));
 
             // Read from disk otherwise
-            foreach (const File &file, src.file.split()) {
-                QScopedPointer<Format> format(Factory<Format>::make(file));
-                Template t = format->read();
+            const QList<File> files = src.file.split();
+            for (int i=0; i<files.size(); i++) {
+                const File &file = files[i];
+                Template t = read(file, prefetched.value(i));
                 if (t.isEmpty())
                     qWarning("Can't open %s from %s", qPrintable(file.flat()), qPrintable(QDir::currentPath()));
                 dst.append(t);
@@ -63,6 +225,32 @@ class OpenTransform : public UntrainableMetaTransform
             }
         }
     }
+
+    void project(const Template &src, Template &dst) const
+    {
+        open(src, dst, QList<QByteArray>());
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if ((Globals->parallelism <= 1) || (src.size() <= 1) || SerialProjectScope::active()) {
+            UntrainableMetaTransform::project(src, dst);
+            return;
+        }
+
+        // Read one block ahead, a block holds one file per thread to bound memory use
+        const int blockSize = Globals->parallelism;
+        dst.clear();
+        dst.reserve(src.size());
+
+        QFuture< QList<Job> > next = QtConcurrent::run(prefetch, this, src.mid(0, blockSize));
+        for (int i=0; i<src.size(); i+=blockSize) {
+            const QList<Job> jobs = next.result();
+            if (i + blockSize < src.size())
+                next = QtConcurrent::run(prefetch, this, src.mid(i + blockSize, blockSize));
+            dst.append(QtConcurrent::blockingMapped< QList<Template> >(jobs, openJob));
+        }
+    }
 };
 
 BR_REGISTER(Transform, OpenTransform)
@@ -15,10 +15,13 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include <QProcess>
 #include <QTemporaryFile>
+#include <QtConcurrent>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/objdetect/objdetect.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/pyramid.h>
 #include <openbr/core/resource.h>
 #include <openbr/core/qtutils.h>
 
@@ -157,8 +160,18 @@ static void trainCascade(const TrainParams &params)
 
 namespace br
 {
-        
-class CascadeResourceMaker : public ResourceMaker<CascadeClassifier>
+
+// Exposes the detection window of both old and new format cascades
+class WindowedCascadeClassifier : public CascadeClassifier
+{
+public:
+    Size windowSize() const
+    {
+        return isOldFormatCascade() ? Size(oldCascade->orig_window_size) : getOriginalWindowSize();
+    }
+};
+
+class CascadeResourceMaker : public ResourceMaker<WindowedCascadeClassifier>
 {
     QString file;
 
@@ -179,9 +192,9 @@ public:
     }
 
 private:
-    CascadeClassifier *make() const
+    WindowedCascadeClassifier *make() const
     {
-        CascadeClassifier *cascade = new CascadeClassifier();
+        WindowedCascadeClassifier *cascade = new WindowedCascadeClassifier();
         if (!cascade->load(file.toStdString()))
             qFatal("Failed to load: %s", qPrintable(file));
         return cascade;
@@ -194,6 +207,8 @@ private:
  * \br_link http://docs.opencv.org/modules/objdetect/doc/cascade_classification.html
  * \author Josh Klontz \cite jklontz
  * \author David Crouse \cite dgcrouse
+ * \br_property bool sharedPyramid If true, the image pyramid is built by OpenBR and kept in a process-wide cache keyed by image and scale, so cascades run over the same image (face, eyes, profile) scale it once. Each level is searched with a single-scale call to the OpenCV cascade, which steps every two pixels at every scale.
+ * \br_property bool parallelScales If true, the scales of a single image are searched concurrently. Implies the same per-level search as sharedPyramid.
  */
 class CascadeTransform : public MetaTransform
 {
@@ -203,6 +218,8 @@ class CascadeTransform : public MetaTransform
     Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
     Q_PROPERTY(bool ROCMode READ get_ROCMode WRITE set_ROCMode RESET reset_ROCMode STORED false)
     Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(bool sharedPyramid READ get_sharedPyramid WRITE set_sharedPyramid RESET reset_sharedPyramid STORED false)
+    Q_PROPERTY(bool parallelScales READ get_parallelScales WRITE set_parallelScales RESET reset_parallelScales STORED false)
 
     // Training parameters 
     Q_PROPERTY(int numStages READ get_numStages WRITE set_numStages RESET reset_numStages STORED false) 
@@ -229,6 +246,8 @@ class CascadeTransform : public MetaTransform
     BR_PROPERTY(int, minNeighbors, 5)
     BR_PROPERTY(bool, ROCMode, false)
     BR_PROPERTY(float, scaleFactor, 1.2)
+    BR_PROPERTY(bool, sharedPyramid, false)
+    BR_PROPERTY(bool, parallelScales, false)
 
     // Training parameters - Default values provided trigger OpenCV defaults
     BR_PROPERTY(int, numStages, -1)
@@ -250,7 +269,17 @@ class CascadeTransform : public MetaTransform
     BR_PROPERTY(bool, show, false)
     BR_PROPERTY(bool, baseFormatSave, false)                    
 
-    Resource<CascadeClassifier> cascadeResource;
+    Resource<WindowedCascadeClassifier> cascadeResource;
+
+    // One level of the image pyramid, searched independently of every other level
+    struct Level
+    {
+        double factor;
+        Size imageSize;
+        std::vector<Rect> rects;
+        std::vector<int> rejectLevels;
+        std::vector<double> levelWeights;
+    };
 
     void init()
     {
@@ -382,7 +411,6 @@ class CascadeTransform : public MetaTransform
 
     void project(const TemplateList &src, TemplateList &dst) const
     {
-        CascadeClassifier *cascade = cascadeResource.acquire();
         foreach (const Template &t, src) {
             // As a special case, skip detection if the appropriate metadata already exists
             if (t.file.contains(model)) {
@@ -412,8 +440,14 @@ class CascadeTransform : public MetaTransform
                 std::vector<Rect> rects;
                 std::vector<int> rejectLevels;
                 std::vector<double> levelWeights;
-                if (ROCMode) cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, scaleFactor, minNeighbors, flags | CASCADE_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
-                else         cascade->detectMultiScale(m, rects, scaleFactor, minNeighbors, flags, Size(minSize, minSize));
+                if (sharedPyramid || parallelScales) {
+                    detectLevels(t.file, m, minSize, flags, rects, rejectLevels, levelWeights);
+                } else {
+                    WindowedCascadeClassifier *cascade = cascadeResource.acquire();
+                    if (ROCMode) cascade->detectMultiScale(m, rects, rejectLevels, levelWeights, scaleFactor, minNeighbors, flags | CASCADE_SCALE_IMAGE, Size(minSize, minSize), Size(), true);
+                    else         cascade->detectMultiScale(m, rects, scaleFactor, minNeighbors, flags, Size(minSize, minSize));
+                    cascadeResource.release(cascade);
+                }
 
                 // It appears that flags is ignored for new model files:
                 // http://docs.opencv.org/modules/objdetect/doc/cascade_classification.html#cascadeclassifier-detectmultiscale
@@ -448,8 +482,102 @@ class CascadeTransform : public MetaTransform
                 }
             }
         }
+    }
 
+    // Mirrors the scale loop of detectMultiScale, searching one pre-scaled level per call.
+    // With CASCADE_FIND_BIGGEST_OBJECT the levels are searched serially from the largest
+    // window down, stopping at the first level that yields a grouped detection.
+    void detectLevels(const File &file, const Mat &m, int minSize, int flags, std::vector<Rect> &rects, std::vector<int> &rejectLevels, std::vector<double> &levelWeights) const
+    {
+        WindowedCascadeClassifier *cascade = cascadeResource.acquire();
+        const Size window = cascade->windowSize();
         cascadeResource.release(cascade);
+
+        QList<Level> levels;
+        for (double factor = 1; ; factor *= scaleFactor) {
+            const Size windowSize(cvRound(window.width*factor), cvRound(window.height*factor));
+            const Size imageSize(cvRound(m.cols/factor), cvRound(m.rows/factor));
+            if (imageSize.width <= window.width || imageSize.height <= window.height)
+                break;
+            if (windowSize.width < minSize || windowSize.height < minSize)
+                continue;
+
+            Level level;
+            level.factor = factor;
+            level.imageSize = imageSize;
+            levels.append(level);
+        }
+
+        const Template src(file, m);
+        if (flags & CASCADE_FIND_BIGGEST_OBJECT) {
+            for (int i=levels.size()-1; i>=0; i--) {
+                detectLevel(src, &levels[i]);
+                if (levels[i].rects.empty())
+                    continue;
+
+                std::vector<Rect> grouped;
+                std::vector<int> groupedRejectLevels;
+                std::vector<double> groupedLevelWeights;
+                for (int j=levels.size()-1; j>=i; j--)
+                    appendLevel(levels[j], grouped, groupedRejectLevels, groupedLevelWeights);
+                group(grouped, groupedRejectLevels, groupedLevelWeights);
+                if (!grouped.empty()) {
+                    rects.swap(grouped);
+                    rejectLevels.swap(groupedRejectLevels);
+                    levelWeights.swap(groupedLevelWeights);
+                    return;
+                }
+            }
+            return;
+        }
+
+        if (parallelScales && (levels.size() > 1)) {
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<levels.size(); i++)
+                futures.addFuture(QtConcurrent::run(this, &CascadeTransform::detectLevel, src, &levels[i]));
+            futures.waitForFinished();
+        } else {
+            for (int i=0; i<levels.size(); i++)
+                detectLevel(src, &levels[i]);
+        }
+
+        foreach (const Level &level, levels)
+            appendLevel(level, rects, rejectLevels, levelWeights);
+        group(rects, rejectLevels, levelWeights);
+    }
+
+    static void appendLevel(const Level &level, std::vector<Rect> &rects, std::vector<int> &rejectLevels, std::vector<double> &levelWeights)
+    {
+        rects.insert(rects.end(), level.rects.begin(), level.rects.end());
+        rejectLevels.insert(rejectLevels.end(), level.rejectLevels.begin(), level.rejectLevels.end());
+        levelWeights.insert(levelWeights.end(), level.levelWeights.begin(), level.levelWeights.end());
+    }
+
+    // Same grouping as detectMultiScale
+    void group(std::vector<Rect> &rects, std::vector<int> &rejectLevels, std::vector<double> &levelWeights) const
+    {
+        if (ROCMode) groupRectangles(rects, rejectLevels, levelWeights, minNeighbors, 0.2);
+        else         groupRectangles(rects, minNeighbors, 0.2);
+    }
+
+    void detectLevel(const Template &src, Level *level) const
+    {
+        Mat scaled;
+        if (sharedPyramid) scaled = FeaturePyramid::scaled(src, level->imageSize, INTER_LINEAR).m();
+        else               resize(src.m(), scaled, level->imageSize, 0, 0, INTER_LINEAR);
+
+        // Each level acquires its own cascade since the OpenCV cascade keeps per-image state.
+        // The scale factor is large enough that only the first scale of the level is searched.
+        WindowedCascadeClassifier *cascade = cascadeResource.acquire();
+        const Size window = cascade->windowSize();
+        std::vector<Rect> rects;
+        if (ROCMode) cascade->detectMultiScale(scaled, rects, level->rejectLevels, level->levelWeights, 1e4, 0, CASCADE_SCALE_IMAGE, window, window, true);
+        else         cascade->detectMultiScale(scaled, rects, 1e4, 0, CASCADE_SCALE_IMAGE, window, window);
+        cascadeResource.release(cascade);
+
+        for (size_t i=0; i<rects.size(); i++)
+            level->rects.push_back(Rect(cvRound(rects[i].x*level->factor), cvRound(rects[i].y*level->factor),
+                                        cvRound(window.width*level->factor), cvRound(window.height*level->factor)));
     }
 
     // TODO: Remove this code when ready to break binary compatibility
@@ -37,6 +37,22 @@ protected:
     UntrainableMetaTransform() : UntrainableTransform(false) {}
 };
 
+/*!
+ * \brief Marks the calling thread as already projecting a parallel chunk.
+ *
+ * While in scope, nested calls to the default Transform::project(TemplateList) run serially
+ * instead of scheduling more tasks on the global thread pool.
+ */
+class BR_EXPORT SerialProjectScope
+{
+    bool previous;
+
+public:
+    SerialProjectScope();
+    ~SerialProjectScope();
+    static bool active();
+};
+
 class TransformCopier : public ResourceMaker<Transform>
 {
 public:
@@ -454,6 +470,50 @@ private:
     void train(const TemplateList &data) { (void) data; }
 };
 
+/*!
+ * \brief A br::Distance that applies an elementwise normalization to the scores of a child distance.
+ *
+ * Batched comparisons score the whole row with the child before normalizing it in a single pass,
+ * so a stack of wrappers costs one pass per layer rather than a virtual call per layer per pair.
+ * Subclasses provide the child through a br::Distance* property named distance.
+ */
+class BR_EXPORT NormalizationDistance : public Distance
+{
+    Q_OBJECT
+
+public:
+    virtual br::Distance *get_distance() const = 0;
+
+    // Normalizes size scores in place
+    virtual void normalize(float *scores, int size) const = 0;
+
+    float compare(const Template &target, const Template &query) const
+    {
+        float score = get_distance()->compare(target, query);
+        normalize(&score, 1);
+        return score;
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores(targets.size());
+        compare(targets, query, scores.data());
+        return scores.toList();
+    }
+
+    void compare(const TemplateList &targets, const Template &query, float *scores) const
+    {
+        get_distance()->compare(targets, query, scores);
+        normalize(scores, targets.size());
+    }
+
+private:
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        compareRows(target, query, output, targetOffset, queryOffset);
+    }
+};
+
 /*!
  * \brief A br::Distance that checks the elements of its list property to see if it needs to be trained.
  */
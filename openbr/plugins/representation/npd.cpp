@@ -48,11 +48,25 @@ class NPDRepresentation : public Representation
     int numFeatures() const { return features.size(); }
     int maxCatCount() const { return 0; }
 
+    QVector<float> featureValues() const
+    {
+        // Every normalized difference of two 8-bit pixels, 39641 distinct values
+        QVector<float> values;
+        values.reserve(256*256);
+        for (int v1 = 0; v1 < 256; v1++)
+            for (int v2 = 0; v2 < 256; v2++)
+                values.append(Feature::npd(v1, v2));
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+        return values;
+    }
+
     struct Feature
     {
         Feature() {}
         Feature(int p0, int p1) : p0(p0), p1(p1) {}
         float calc(const Mat &image) const;
+        static inline float npd(int v1, int v2) { return (v1 + v2) == 0 ? 0 : (1.0 * (v1 - v2)) / (v1 + v2); }
 
         int p0, p1;
     };
@@ -64,8 +78,7 @@ BR_REGISTER(Representation, NPDRepresentation)
 inline float NPDRepresentation::Feature::calc(const Mat &image) const
 {
     const uchar *ptr = image.ptr();
-    int v1 = (int)ptr[p0], v2 = (int)ptr[p1];
-    return (v1 + v2) == 0 ? 0 : (1.0 * (v1 - v2)) / (v1 + v2);
+    return npd((int)ptr[p0], (int)ptr[p1]);
 }
 
 } // namespace br
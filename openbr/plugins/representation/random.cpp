@@ -82,6 +82,11 @@ class RandomRepresentation : public Representation
         return representation->maxCatCount();
     }
 
+    QVector<float> featureValues() const
+    {
+        return representation->featureValues();
+    }
+
     void load(QDataStream &stream)
     {
         representation->load(stream);
@@ -1,10 +1,14 @@
 #include <QFile>
+#include <QFileInfo>
 #include <QFutureSynchronizer>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QThreadPool>
 #include <QtConcurrent>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 #include "universal_template.h"
 
@@ -107,6 +111,200 @@ int br_iterate_utemplates_file(FILE *file, br_utemplate_callback callback, br_ca
     return count;
 }
 
+// Sidecar index record, one per template in file order
+struct br_utemplate_index_entry
+{
+    uint64_t offset;
+    uint64_t size; // Including the header
+    uint32_t personID;
+    uint32_t frame;
+};
+
+struct br_mapped_utemplates
+{
+    QFile file;
+    const char *data;
+    qint64 size;
+    QFile indexFile; // The sidecar index is mapped in place when it is up to date
+    std::vector<br_utemplate_index_entry> builtIndex; // Otherwise it is built here
+    const br_utemplate_index_entry *index;
+    int64_t count;
+    std::vector<int64_t> byIdentity; // Positions in index sorted by (personID, frame, position)
+};
+
+static inline br_const_utemplate utemplateAt(const br_mapped_utemplates *mapped, int64_t i)
+{
+    return reinterpret_cast<br_const_utemplate>(mapped->data + mapped->index[i].offset);
+}
+
+static bool loadIndex(br_mapped_utemplates *mapped, const QString &indexFileName)
+{
+    const QFileInfo indexInfo(indexFileName);
+    if (!indexInfo.exists() || (indexInfo.lastModified() < QFileInfo(mapped->file).lastModified()))
+        return false;
+
+    mapped->indexFile.setFileName(indexFileName);
+    if (!mapped->indexFile.open(QFile::ReadOnly) || (mapped->indexFile.size() % sizeof(br_utemplate_index_entry) != 0))
+        return false;
+
+    const int64_t count = mapped->indexFile.size() / sizeof(br_utemplate_index_entry);
+    const br_utemplate_index_entry *index = count ? reinterpret_cast<const br_utemplate_index_entry*>(mapped->indexFile.map(0, mapped->indexFile.size())) : NULL;
+    if (count && !index)
+        return false;
+
+    // Records must tile the file exactly
+    uint64_t offset = 0;
+    for (int64_t i=0; i<count; i++) {
+        if ((index[i].offset != offset) ||
+            (index[i].size < sizeof(br_universal_template)) ||
+            (index[i].size > uint64_t(mapped->size) - offset))
+            return false;
+        offset += index[i].size;
+    }
+    if (offset != uint64_t(mapped->size))
+        return false;
+
+    mapped->index = index;
+    mapped->count = count;
+    return true;
+}
+
+static void buildIndex(br_mapped_utemplates *mapped)
+{
+    mapped->builtIndex.clear();
+    qint64 offset = 0;
+    while (offset + qint64(sizeof(br_universal_template)) <= mapped->size) {
+        const br_const_utemplate t = reinterpret_cast<br_const_utemplate>(mapped->data + offset);
+        const qint64 next = offset + sizeof(br_universal_template) + t->mdSize + t->fvSize;
+        if (next > mapped->size)
+            break;
+
+        br_utemplate_index_entry entry;
+        entry.offset = offset;
+        entry.size = next - offset;
+        entry.personID = t->personID;
+        entry.frame = t->frame;
+        mapped->builtIndex.push_back(entry);
+        offset = next;
+    }
+
+    if (offset != mapped->size)
+        qWarning("Ignoring %lld trailing bytes of partial template.", mapped->size - offset);
+
+    mapped->index = mapped->builtIndex.empty() ? NULL : &mapped->builtIndex[0];
+    mapped->count = mapped->builtIndex.size();
+}
+
+struct IdentityLess
+{
+    const br_utemplate_index_entry *index;
+    IdentityLess(const br_utemplate_index_entry *index) : index(index) {}
+
+    bool operator()(int64_t a, int64_t b) const
+    {
+        if (index[a].personID != index[b].personID) return index[a].personID < index[b].personID;
+        if (index[a].frame != index[b].frame) return index[a].frame < index[b].frame;
+        return a < b;
+    }
+};
+
+br_utemplate_file br_open_utemplates_file(const char *fileName, bool writeIndex)
+{
+    br_mapped_utemplates *mapped = new br_mapped_utemplates();
+    mapped->index = NULL;
+    mapped->count = 0;
+    mapped->file.setFileName(fileName);
+    if (!mapped->file.open(QFile::ReadOnly)) {
+        delete mapped;
+        return NULL;
+    }
+
+    mapped->size = mapped->file.size();
+    mapped->data = mapped->size ? reinterpret_cast<const char*>(mapped->file.map(0, mapped->size)) : NULL;
+    if (mapped->size && !mapped->data) {
+        delete mapped;
+        return NULL;
+    }
+
+    const QString indexFileName = QString(fileName) + ".index";
+    if (!loadIndex(mapped, indexFileName)) {
+        mapped->indexFile.close();
+        buildIndex(mapped);
+        if (writeIndex) {
+            QFile indexFile(indexFileName);
+            const qint64 bytes = qint64(mapped->count) * sizeof(br_utemplate_index_entry);
+            if (!indexFile.open(QFile::WriteOnly) || (indexFile.write(reinterpret_cast<const char*>(mapped->index), bytes) != bytes))
+                qWarning("Failed to write index %s.", qPrintable(indexFileName));
+        }
+    }
+
+    mapped->byIdentity.resize(mapped->count);
+    for (int64_t i=0; i<mapped->count; i++)
+        mapped->byIdentity[i] = i;
+    std::sort(mapped->byIdentity.begin(), mapped->byIdentity.end(), IdentityLess(mapped->index));
+
+    return mapped;
+}
+
+void br_close_utemplates_file(br_utemplate_file file)
+{
+    delete file;
+}
+
+int64_t br_num_utemplates(br_utemplate_file file)
+{
+    return file->count;
+}
+
+br_const_utemplate br_get_utemplate(br_utemplate_file file, int64_t index)
+{
+    if ((index < 0) || (index >= file->count))
+        return NULL;
+    return utemplateAt(file, index);
+}
+
+br_const_utemplate br_find_utemplate(br_utemplate_file file, uint32_t personID, uint32_t frame)
+{
+    int64_t lo = 0, hi = file->count;
+    while (lo < hi) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        const br_utemplate_index_entry &entry = file->index[file->byIdentity[mid]];
+        if ((entry.personID < personID) || ((entry.personID == personID) && (entry.frame < frame))) lo = mid + 1;
+        else                                                                                         hi = mid;
+    }
+
+    if (lo == file->count)
+        return NULL;
+    const br_utemplate_index_entry &entry = file->index[file->byIdentity[lo]];
+    if ((entry.personID != personID) || (entry.frame != frame))
+        return NULL;
+    return utemplateAt(file, file->byIdentity[lo]);
+}
+
+static void iterateRange(const br_mapped_utemplates *mapped, int64_t begin, int64_t end, br_utemplate_callback callback, br_callback_context context)
+{
+    for (int64_t i=begin; i<end; i++)
+        callback(utemplateAt(mapped, i), context);
+}
+
+int64_t br_iterate_utemplates_mapped(br_utemplate_file file, br_utemplate_callback callback, br_callback_context context, bool parallel)
+{
+    const int64_t count = file->count;
+    if (!parallel) {
+        iterateRange(file, 0, count, callback, context);
+        return count;
+    }
+
+    // A few ranges per thread to balance templates of uneven size
+    const int64_t ranges = 4 * std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+    const int64_t rangeSize = std::max(int64_t(1), (count + ranges - 1) / ranges);
+    QFutureSynchronizer<void> futures;
+    for (int64_t i=0; i<count; i+=rangeSize)
+        futures.addFuture(QtConcurrent::run(iterateRange, (const br_mapped_utemplates*) file, i, std::min(i + rangeSize, count), callback, context));
+    futures.waitForFinished();
+    return count;
+}
+
 void br_log(const char *message)
 {
     qDebug() << qPrintable(QTime::currentTime().toString("hh:mm:ss.zzz")) << "-" << message;
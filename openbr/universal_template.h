@@ -92,6 +92,55 @@ BR_EXPORT void br_iterate_utemplates(br_const_utemplate begin, br_const_utemplat
  */
 BR_EXPORT int br_iterate_utemplates_file(FILE *file, br_utemplate_callback callback, br_callback_context context, bool parallel);
 
+/*!
+ * \brief A read-only, memory-mapped file of br_universal_template with an offset index.
+ * \see br_open_utemplates_file
+ */
+typedef struct br_mapped_utemplates *br_utemplate_file;
+
+/*!
+ * \brief Map a file of br_universal_template for in-place access.
+ *
+ * The offset index is memory-mapped from the <tt>.index</tt> sidecar next to \em fileName when it is present, up to date
+ * and its records exactly tile the file, otherwise it is rebuilt by scanning the template headers and,
+ * if \em writeIndex is set, saved to the sidecar. Counts and positions are 64-bit, so files may hold billions of templates.
+ * \return NULL if the file can't be opened or mapped.
+ * \see br_close_utemplates_file
+ */
+BR_EXPORT br_utemplate_file br_open_utemplates_file(const char *fileName, bool writeIndex);
+
+/*!
+ * \brief Unmap a file opened with br_open_utemplates_file, invalidating all templates it returned.
+ */
+BR_EXPORT void br_close_utemplates_file(br_utemplate_file file);
+
+/*!
+ * \brief Number of br_universal_template in a mapped file.
+ */
+BR_EXPORT int64_t br_num_utemplates(br_utemplate_file file);
+
+/*!
+ * \brief Random access to the template at \em index in file order.
+ * \return NULL if \em index is out of range.
+ */
+BR_EXPORT br_const_utemplate br_get_utemplate(br_utemplate_file file, int64_t index);
+
+/*!
+ * \brief Random access by identity.
+ * \return The first template in file order matching \em personID and \em frame, or NULL if there is none.
+ */
+BR_EXPORT br_const_utemplate br_find_utemplate(br_utemplate_file file, uint32_t personID, uint32_t frame);
+
+/*!
+ * \brief Iterate over a mapped file without copying templates.
+ *
+ * In parallel mode the index is split into contiguous ranges that are processed concurrently,
+ * templates within a range are visited in file order.
+ * \return The number of templates iterated
+ * \see br_iterate_utemplates_file
+ */
+BR_EXPORT int64_t br_iterate_utemplates_mapped(br_utemplate_file file, br_utemplate_callback callback, br_callback_context context, bool parallel);
+
 /*!
  * \brief Write a message annotated with the current time to stderr.
  */